@@ -0,0 +1,240 @@
+/*
+ * TRBBFI - The Really Better Brainfuck Interpreter
+ * Author: TheRealOwenJ
+ * Repository: https://github.com/TheRealOwenJ/trbbfi
+ *
+ * Licensed under GNU GPL v3 to prevent theft.
+ * See LICENSE file for details.
+ */
+
+#include "batch.h"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+namespace fs = std::filesystem;
+using namespace trbbfi;
+
+namespace {
+
+constexpr size_t OUTPUT_CHUNK = 65536;
+
+// Each worker takes inputs from the back of its own queue and, once that
+// is empty, steals from the front of the others', so a worker held up by
+// a long input does not hold back the short ones queued behind it.
+class WorkQueues {
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> items;
+    };
+    std::vector<Queue> queues;
+
+public:
+    WorkQueues(size_t workers, size_t items) : queues(workers) {
+        for (size_t w = 0; w < workers; w++)
+            for (size_t i = w * items / workers; i < (w + 1) * items / workers; i++) queues[w].items.push_back(i);
+    }
+
+    bool next(size_t worker, size_t& item) {
+        {
+            Queue& own = queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.items.empty()) {
+                item = own.items.back();
+                own.items.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++) {
+            Queue& victim = queues[(worker + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.items.empty()) {
+                item = victim.items.front();
+                victim.items.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+void writeFile(void* user, const char* data, size_t size) {
+    std::fwrite(data, 1, size, static_cast<std::FILE*>(user));
+}
+
+class Batch {
+private:
+    const Program& program;
+    const BatchOptions& options;
+    std::vector<fs::path> inputs;
+    WorkQueues queues;
+    std::mutex report;
+    std::mutex covered;
+    std::atomic<size_t> failed{0};
+    std::atomic<size_t> fallbacks{0};
+
+    void fail(const fs::path& input, const std::string& message) {
+        failed++;
+        std::lock_guard<std::mutex> lock(report);
+        std::cerr << "Error: " << input.filename().string() << ": " << message << "\n";
+    }
+
+public:
+    Batch(const Program& compiled, const BatchOptions& batch_options, std::vector<fs::path> files, size_t workers,
+          size_t items)
+        : program(compiled), options(batch_options), inputs(std::move(files)), queues(workers, items) {}
+
+    // The tape, output buffer and input buffer belong to the worker and are
+    // reused for every input it runs.
+    void work(size_t worker) {
+        Machine machine;
+        std::vector<char> buffer(OUTPUT_CHUNK);
+        machine.setMaxSteps(options.max_steps);
+        machine.setTimeLimit(options.timeout);
+        OutputSink& sink = machine.output();
+        sink.buffer = buffer.data();
+        sink.capacity = buffer.size();
+        sink.flush = writeFile;
+
+        if (options.lanes) {
+            workLanes(worker, machine);
+            return;
+        }
+        machine.setCoverage(options.coverage != nullptr);
+        Coverage coverage;
+        std::vector<unsigned char> input;
+        size_t item;
+        while (queues.next(worker, item)) {
+            if (!read(item, input)) continue;
+            runScalar(machine, item, input);
+            if (options.coverage) machine.addCoverage(coverage);
+        }
+        if (options.coverage && coverage.runs) {
+            std::lock_guard<std::mutex> lock(covered);
+            options.coverage->merge(coverage);
+        }
+    }
+
+    // Work items are groups of LANES inputs. A group the lanes cannot keep
+    // in step, or that reaches a limit, is run again one input at a time.
+    void workLanes(size_t worker, Machine& machine) {
+        LaneMachine lanes;
+        lanes.setMaxSteps(options.max_steps);
+        lanes.setTimeLimit(options.timeout);
+        std::vector<unsigned char> group_inputs[LaneMachine::LANES];
+        InputSource sources[LaneMachine::LANES];
+        size_t items[LaneMachine::LANES];
+        size_t group;
+        while (queues.next(worker, group)) {
+            size_t count = 0;
+            for (size_t item = group * LaneMachine::LANES; item < std::min(inputs.size(), (group + 1) * LaneMachine::LANES);
+                 item++) {
+                if (!read(item, group_inputs[count])) continue;
+                sources[count] = InputSource();
+                sources[count].data = group_inputs[count].data();
+                sources[count].size = group_inputs[count].size();
+                items[count++] = item;
+            }
+            if (count && lanes.run(program, sources, count)) {
+                for (size_t lane = 0; lane < count; lane++) writeOutput(items[lane], lanes.output(lane));
+            } else if (!lanes.error().empty()) {
+                for (size_t lane = 0; lane < count; lane++) fail(inputs[items[lane]], lanes.error());
+            } else {
+                fallbacks++;
+                for (size_t lane = 0; lane < count; lane++) runScalar(machine, items[lane], group_inputs[lane]);
+            }
+        }
+    }
+
+    bool read(size_t item, std::vector<unsigned char>& input) {
+        std::ifstream file(inputs[item], std::ios::binary);
+        if (!file) {
+            fail(inputs[item], "Cannot open input");
+            return false;
+        }
+        input.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    fs::path outputPath(size_t item) const { return fs::path(options.outputs) / inputs[item].filename(); }
+
+    void writeOutput(size_t item, const std::string& output) {
+        fs::path out_path = outputPath(item);
+        std::FILE* out = std::fopen(out_path.string().c_str(), "wb");
+        if (!out) { fail(inputs[item], "Cannot create " + out_path.string()); return; }
+        std::fwrite(output.data(), 1, output.size(), out);
+        if (std::fclose(out) != 0) fail(inputs[item], "Cannot write " + out_path.string());
+    }
+
+    void runScalar(Machine& machine, size_t item, const std::vector<unsigned char>& input) {
+        const fs::path& path = inputs[item];
+        fs::path out_path = outputPath(item);
+        std::FILE* out = std::fopen(out_path.string().c_str(), "wb");
+        if (!out) { fail(path, "Cannot create " + out_path.string()); return; }
+        OutputSink& sink = machine.output();
+        sink.size = 0;
+        sink.user = out;
+        InputSource& source = machine.input();
+        source.data = input.data();
+        source.size = input.size();
+        source.pos = 0;
+        bool ok = machine.run(program);
+        if (std::fclose(out) != 0) fail(path, "Cannot write " + out_path.string());
+        else if (!ok) fail(path, machine.error());
+    }
+
+    size_t count() const { return inputs.size(); }
+    size_t failures() const { return failed; }
+    size_t fallbackGroups() const { return fallbacks; }
+};
+
+}  // namespace
+
+int runBatch(const Program& program, const BatchOptions& batch_options) {
+    // The lanes keep no coverage, so a batch collecting it runs one input
+    // at a time.
+    BatchOptions options = batch_options;
+    if (options.coverage) options.lanes = false;
+    std::vector<fs::path> inputs;
+    std::error_code error;
+    for (fs::directory_iterator it(options.inputs, error), end; !error && it != end; it.increment(error))
+        if (it->is_regular_file()) inputs.push_back(it->path());
+    if (error) {
+        std::cerr << "Error: Cannot read " << options.inputs << ": " << error.message() << "\n";
+        return 1;
+    }
+    std::sort(inputs.begin(), inputs.end());
+    fs::create_directories(options.outputs, error);
+    if (error) {
+        std::cerr << "Error: Cannot create " << options.outputs << ": " << error.message() << "\n";
+        return 1;
+    }
+
+    size_t items = options.lanes ? (inputs.size() + LaneMachine::LANES - 1) / LaneMachine::LANES : inputs.size();
+    size_t workers = options.jobs ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+    workers = std::max<size_t>(1, std::min(workers, items));
+    auto started = std::chrono::steady_clock::now();
+    Batch batch(program, options, std::move(inputs), workers, items);
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; w++) threads.emplace_back(&Batch::work, &batch, w);
+    batch.work(0);
+    for (auto& thread : threads) thread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::cerr << "Ran " << batch.count() << " inputs on " << workers << " threads in " << seconds << "s, "
+              << batch.failures() << " failed\n";
+    if (options.lanes)
+        std::cerr << batch.fallbackGroups() << " of " << items << " groups ran one input at a time\n";
+    return batch.failures() ? 1 : 0;
+}
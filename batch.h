@@ -0,0 +1,35 @@
+/*
+ * TRBBFI - The Really Better Brainfuck Interpreter
+ * Author: TheRealOwenJ
+ * Repository: https://github.com/TheRealOwenJ/trbbfi
+ *
+ * Licensed under GNU GPL v3 to prevent theft.
+ * See LICENSE file for details.
+ */
+
+// Batch mode: one program run on every file in a directory, writing each
+// run's output to a file of the same name in another directory.
+
+#ifndef TRBBFI_BATCH_H
+#define TRBBFI_BATCH_H
+
+#include "trbbfi.h"
+
+#include <cstdint>
+#include <string>
+
+struct BatchOptions {
+    std::string inputs;
+    std::string outputs;
+    unsigned jobs = 0;  // 0 uses every core
+    uint64_t max_steps = 0;
+    double timeout = 0;
+    bool lanes = false;  // run inputs LaneMachine::LANES at a time, unless collecting coverage
+    trbbfi::Coverage* coverage = nullptr;  // when set, every run is added to it
+};
+
+// Runs the compiled program once per input on a pool of threads. Returns
+// the process exit code: 0 when every run succeeded.
+int runBatch(const trbbfi::Program& program, const BatchOptions& options);
+
+#endif
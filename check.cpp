@@ -0,0 +1,553 @@
+/*
+ * TRBBFI - The Really Better Brainfuck Interpreter
+ * Author: TheRealOwenJ
+ * Repository: https://github.com/TheRealOwenJ/trbbfi
+ *
+ * Licensed under GNU GPL v3 to prevent theft.
+ * See LICENSE file for details.
+ */
+
+
+// Checks run by `make check` of what `make test` cannot see: that a
+// program writes the same at every -O level, that a run suspended and
+// resumed at every chance ends like a straight one, that corrupt bytecode
+// is refused or run safely, that a watchpoint catches a write undone soon
+// after, and the server protocol against a running `trbbfi --serve`.
+//
+// Usage: trbbfi-check ./trbbfi
+
+#include "trbbfi.h"
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef _WIN32
+#include <csignal>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace trbbfi;
+
+namespace {
+
+int failures = 0;
+
+void expect(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cout << "FAIL: " << what << "\n";
+    failures++;
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+bool writeFile(const std::string& path, const std::string& data) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), static_cast<std::streamsize>(data.size()));
+    return static_cast<bool>(file);
+}
+
+struct Case {
+    const char* name;
+    std::string source;
+    std::string input;
+};
+
+// Small programs that between them reach every op: folded blocks behind
+// guards, clear and multiply loops, constant and cell output, and input,
+// and loops that step left of the first cell with nothing to multiply.
+std::vector<Case> cases() {
+    return {
+        {"hello", "++++++++[>++++[>++>+++>+++>+<<<<-]>+>+>->>+[<]<-]>>.>---.+++++++..+++.>>.<-.<.+++.------.--------.>>+.>++.", ""},
+        {"blocks", "++++++[>++++++++<-]>[>+>++<<-]>>+.<.<<[-]>>>>+<<.>.>[-]++++++++++.", ""},
+        {"cat", ",[.,]", "resumable\n"},
+        {"reverse", ">,[>,]<[.<]", "0123456789"},
+        {"double", ",[>++<-]>[<+>-]<.,[.[-],]", "!abc"},
+        {"nested", "++++[>++++[>++++[>+>+<<-]<-]<-]>>>[.-]", ""},
+        {"left", "+[<>-]<.", ""},
+        {"left2", "+[<<>>-]<<.", ""},
+    };
+}
+
+// What a run wrote and how many steps it took.
+struct Outcome {
+    bool done = false;
+    std::string output;
+    uint64_t steps = 0;
+};
+
+void append(void* user, const char* data, size_t size) {
+    static_cast<std::string*>(user)->append(data, size);
+}
+
+Outcome runStraight(const Program& program, const std::string& input) {
+    Outcome outcome;
+    Machine machine;
+    std::vector<char> buffer(4096);
+    machine.output().buffer = buffer.data();
+    machine.output().capacity = buffer.size();
+    machine.output().user = &outcome.output;
+    machine.output().flush = append;
+    machine.input().data = reinterpret_cast<const unsigned char*>(input.data());
+    machine.input().size = input.size();
+    machine.input().closed = true;
+    outcome.done = machine.run(program);
+    outcome.steps = machine.steps();
+    return outcome;
+}
+
+// Runs with one byte of output room, one byte of input at a time, and a
+// step limit raised by a few steps each time it is reached, so the run
+// suspends about as often as it can.
+Outcome runResumed(const Program& program, const std::string& input, uint64_t stride) {
+    Outcome outcome;
+    Machine machine;
+    char byte = 0;
+    machine.output().buffer = &byte;
+    machine.output().capacity = 1;
+    uint64_t limit = stride;
+    machine.setMaxSteps(limit);
+    machine.start(program);
+    size_t fed = 0;
+    for (int suspensions = 0; suspensions < 1000000; suspensions++) {
+        RunStatus status = machine.resume();
+        if (status == RunStatus::OutputReady || status == RunStatus::Done) {
+            outcome.output.append(machine.output().buffer, machine.output().size);
+            machine.output().size = 0;
+        }
+        if (status == RunStatus::OutputReady) continue;
+        if (status == RunStatus::NeedInput) {
+            if (fed < input.size()) {
+                machine.input().data = reinterpret_cast<const unsigned char*>(input.data()) + fed++;
+                machine.input().size = 1;
+                machine.input().pos = 0;
+            } else {
+                machine.input().closed = true;
+            }
+            continue;
+        }
+        if (status == RunStatus::FuelExhausted) {
+            machine.setMaxSteps(limit += stride);
+            continue;
+        }
+        outcome.done = status == RunStatus::Done;
+        break;
+    }
+    outcome.steps = machine.steps();
+    return outcome;
+}
+
+void checkResume() {
+    int runs = 0;
+    for (const Case& c : cases()) {
+        std::string unoptimized;
+        for (int level = 0; level <= 3; level++) {
+            CompileOptions options;
+            options.opt_level = level;
+            Program program;
+            program.setCompileOptions(options);
+            if (!program.compile(c.source)) {
+                expect(false, std::string(c.name) + " does not compile: " + program.error());
+                continue;
+            }
+            Outcome straight = runStraight(program, c.input);
+            expect(straight.done, std::string(c.name) + " fails at -O" + std::to_string(level));
+            if (level == 0) unoptimized = straight.output;
+            expect(straight.output == unoptimized,
+                   std::string(c.name) + " writes different output at -O" + std::to_string(level));
+            for (uint64_t stride : {1, 7, 1000}) {
+                Outcome resumed = runResumed(program, c.input, stride);
+                std::string what = std::string(c.name) + " at -O" + std::to_string(level) +
+                                   " resumed every " + std::to_string(stride) + " steps";
+                expect(resumed.done, what + " does not finish");
+                expect(resumed.output == straight.output, what + " writes different output");
+                expect(resumed.steps == straight.steps, what + " takes a different number of steps");
+                runs++;
+            }
+        }
+    }
+    std::cout << "Resume: " << runs << " resumed runs checked\n";
+}
+
+#ifndef _WIN32
+// A watched cell set and cleared again between two looks must still stop
+// the run, twice per iteration, just after each write.
+void checkWatchpoints() {
+    int checked = 0;
+    for (int level = 0; level <= 3; level++) {
+        CompileOptions options;
+        options.opt_level = level;
+        Program program;
+        program.setCompileOptions(options);
+        program.compile("++++++++[>+<.>-<-]");
+        std::string output;
+        std::vector<char> buffer(4096);
+        Machine machine;
+        machine.output().buffer = buffer.data();
+        machine.output().capacity = buffer.size();
+        machine.output().user = &output;
+        machine.output().flush = append;
+        machine.addWatchpoint(1);
+        machine.start(program);
+        std::string what = "watching cell 1 at -O" + std::to_string(level);
+        int stops = 0;
+        RunStatus status;
+        while ((status = machine.resume()) == RunStatus::Stopped && stops < 100) {
+            bool set = stops % 2 == 0;
+            expect(machine.error() == std::string("Watchpoint: cell 1 changed from ") + (set ? "0 to 1" : "1 to 0"),
+                   what + " stops with \"" + machine.error() + "\"");
+            expect(machine.location() == (set ? 11u : 15u), what + " stops at " + std::to_string(machine.location()));
+            expect(output.size() == static_cast<size_t>((stops + 1) / 2), what + " holds back the wrong output");
+            stops++;
+        }
+        expect(status == RunStatus::Done && stops == 16, what + " stops " + std::to_string(stops) + " times");
+        checked += stops;
+    }
+    std::cout << "Watchpoints: " << checked << " stops checked\n";
+}
+#endif
+
+// Bytecode layout as trbbfi.h's loader reads it: the checksum is the u64
+// at offset 16, FNV-1a over 64-bit words of everything after the 64-byte
+// header.
+constexpr size_t BYTECODE_HEADER = 64;
+constexpr size_t CHECKSUM_AT = 16;
+
+void reseal(std::string& file) {
+    if (file.size() < BYTECODE_HEADER) return;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = BYTECODE_HEADER;
+    for (; i + 8 <= file.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, file.data() + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < file.size(); i++) hash = (hash ^ static_cast<unsigned char>(file[i])) * 1099511628211ULL;
+    std::memcpy(&file[CHECKSUM_AT], &hash, 8);
+}
+
+// Loads a corrupt file over the program loaded from good_path: it must
+// either be refused, leaving that program as it was, or load and then run
+// without crashing. Returns true if it loaded.
+bool tryCorrupt(Program& program, const std::string& good_path, const std::string& path,
+                const std::string& data, const Case& c, const Outcome& good, const std::string& what) {
+    writeFile(path, data);
+    if (program.load(path)) {
+        Machine machine;
+        std::string output;
+        std::vector<char> buffer(256);
+        machine.output().buffer = buffer.data();
+        machine.output().capacity = buffer.size();
+        machine.output().user = &output;
+        machine.output().flush = [](void* user, const char* bytes, size_t size) {
+            std::string& out = *static_cast<std::string*>(user);
+            if (out.size() < 4096) out.append(bytes, size);
+        };
+        machine.setMaxSteps(100000);
+        machine.run(program);
+        expect(program.load(good_path), what + " keeps the good file from loading again");
+        return true;
+    }
+    expect(!program.error().empty(), what + " is refused without an error");
+    Outcome kept = runStraight(program, c.input);
+    expect(kept.done && kept.output == good.output, what + " replaced the loaded program");
+    return false;
+}
+
+void checkBytecode(const std::string& dir) {
+    int refused = 0, loaded = 0;
+    for (const Case& c : cases()) {
+        CompileOptions options;
+        options.opt_level = 3;
+        Program compiled;
+        compiled.setCompileOptions(options);
+        std::string path = dir + "/" + c.name + ".bfc", bad = dir + "/bad.bfc";
+        if (!compiled.compile(c.source) || !compiled.saveBytecode(path)) {
+            expect(false, std::string(c.name) + " cannot be saved: " + compiled.error());
+            continue;
+        }
+        Outcome good = runStraight(compiled, c.input);
+        std::string file = readFile(path);
+        Program program;
+        expect(program.load(path), std::string(c.name) + ".bfc does not load: " + program.error());
+        Outcome reloaded = runStraight(program, c.input);
+        expect(reloaded.done && reloaded.output == good.output, std::string(c.name) + ".bfc runs differently");
+
+        // A file cut short is refused once it still has the magic; before
+        // that it is not bytecode and loads as source.
+        for (size_t size = 0; size < file.size(); size++) {
+            std::string what = std::string(c.name) + ".bfc cut to " + std::to_string(size) + " bytes";
+            if (tryCorrupt(program, path, bad, file.substr(0, size), c, good, what)) {
+                expect(size < 4, what + " loads");
+                loaded++;
+            } else {
+                refused++;
+            }
+        }
+        // A changed byte after the header fails the checksum; with the
+        // checksum fixed up it reaches the verifier. A changed header is
+        // refused or, like unused flags or a code size that stays within
+        // its padding, harmless.
+        for (size_t at = 0; at < file.size(); at++) {
+            for (int mask : {0x01, 0x80, 0xff}) {
+                std::string data = file;
+                data[at] = static_cast<char>(data[at] ^ mask);
+                std::string what = std::string(c.name) + ".bfc with byte " + std::to_string(at) + " ^ " +
+                                   std::to_string(mask);
+                if (tryCorrupt(program, path, bad, data, c, good, what)) {
+                    expect(at < BYTECODE_HEADER, what + " passes the checksum");
+                    loaded++;
+                } else {
+                    refused++;
+                }
+                if (at < BYTECODE_HEADER) continue;
+                reseal(data);
+                if (tryCorrupt(program, path, bad, data, c, good, what + " resealed")) loaded++;
+                else refused++;
+            }
+        }
+        std::remove(path.c_str());
+        std::remove(bad.c_str());
+    }
+    std::cout << "Bytecode: " << refused << " corrupt files refused, " << loaded << " loaded and ran safely\n";
+}
+
+#ifndef _WIN32
+
+void put32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out += static_cast<char>(value >> (8 * i));
+}
+
+void put64(std::string& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out += static_cast<char>(value >> (8 * i));
+}
+
+uint64_t get(const std::string& data, size_t at, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) value = value << 8 | static_cast<unsigned char>(data[at + static_cast<size_t>(i)]);
+    return value;
+}
+
+// A request frame as server.h lays it out.
+std::string request(uint8_t kind, const std::string& program, const std::string& input,
+                    uint64_t max_steps, uint32_t timeout_ms) {
+    std::string frame;
+    put32(frame, static_cast<uint32_t>(24 + program.size() + input.size()));
+    frame += static_cast<char>(kind);
+    frame += std::string(3, '\0');
+    put64(frame, max_steps);
+    put32(frame, timeout_ms);
+    put32(frame, static_cast<uint32_t>(program.size()));
+    put32(frame, static_cast<uint32_t>(input.size()));
+    return frame + program + input;
+}
+
+struct Reply {
+    bool ok = false;
+    int status = -1;
+    bool cached = false;
+    uint64_t hash = 0;
+    uint64_t steps = 0;
+    std::string output;
+    std::string error;
+};
+
+int connectTo(const std::string& path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) return fd;
+    if (fd >= 0) ::close(fd);
+    return -1;
+}
+
+bool sendAll(int fd, const std::string& data) {
+    for (size_t sent = 0; sent < data.size();) {
+        ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool receive(int fd, std::string& data, size_t size) {
+    data.resize(size);
+    for (size_t got = 0; got < size;) {
+        ssize_t n = ::read(fd, &data[got], size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        got += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+Reply readReply(int fd) {
+    Reply reply;
+    std::string length, frame;
+    if (!receive(fd, length, 4) || !receive(fd, frame, get(length, 0, 4)) || frame.size() < 44) return reply;
+    size_t output_size = get(frame, 36, 4), error_size = get(frame, 40, 4);
+    if (frame.size() != 44 + output_size + error_size) return reply;
+    reply.ok = true;
+    reply.status = static_cast<unsigned char>(frame[0]);
+    reply.cached = frame[1] != 0;
+    reply.hash = get(frame, 4, 8);
+    reply.steps = get(frame, 12, 8);
+    reply.output = frame.substr(44, output_size);
+    reply.error = frame.substr(44 + output_size);
+    return reply;
+}
+
+Reply ask(const std::string& path, const std::string& frame) {
+    int fd = connectTo(path);
+    if (fd < 0) return Reply();
+    Reply reply = sendAll(fd, frame) ? readReply(fd) : Reply();
+    ::close(fd);
+    return reply;
+}
+
+enum { DONE = 0, ERROR = 1, LIMIT = 2, UNKNOWN = 3 };
+
+void checkServer(const std::string& trbbfi, const std::string& dir, bool isolate) {
+    std::string path = dir + (isolate ? "/isolated.sock" : "/serve.sock");
+    std::string mode = isolate ? "isolated server: " : "server: ";
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = ::open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        execl(trbbfi.c_str(), trbbfi.c_str(), "--serve", path.c_str(), isolate ? "--isolate" : nullptr,
+              static_cast<char*>(nullptr));
+        std::_Exit(127);
+    }
+    int fd = -1;
+    for (int tries = 0; pid > 0 && fd < 0 && tries < 500; tries++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        fd = connectTo(path);
+    }
+    if (fd < 0) {
+        expect(false, mode + "does not start");
+        if (pid > 0) kill(pid, SIGKILL);
+        return;
+    }
+    ::close(fd);
+    const Case hello = cases()[0];
+    int checks = 0;
+    auto check = [&](bool ok, const std::string& what) {
+        expect(ok, mode + what);
+        checks++;
+    };
+
+    Reply first = ask(path, request(0, hello.source, "", 0, 0));
+    check(first.ok && first.status == DONE && first.output == "Hello World!\n" && !first.cached, "hello is not run");
+    Reply again = ask(path, request(0, hello.source, "", 0, 0));
+    check(again.ok && again.cached && again.hash == first.hash && again.steps == first.steps, "hello is not cached");
+    std::string hash;
+    put64(hash, first.hash);
+    Reply by_hash = ask(path, request(1, hash, "", 0, 0));
+    check(by_hash.ok && by_hash.status == DONE && by_hash.output == first.output, "a cached hash is not run");
+    std::string unknown;
+    put64(unknown, first.hash ^ 1);
+    check(ask(path, request(1, unknown, "", 0, 0)).status == UNKNOWN, "an unknown hash is not refused");
+
+    Reply echo = ask(path, request(0, ",[.,]", "echo", 0, 0));
+    check(echo.status == DONE && echo.output == "echo", "input is not echoed");
+    Reply steps = ask(path, request(0, "+[]", "", 1000, 0));
+    check(steps.status == LIMIT, "a step limit is not enforced");
+    Reply timeout = ask(path, request(0, "+[]", "", 0, 200));
+    check(timeout.status == LIMIT, "a time limit is not enforced");
+    Reply unbalanced = ask(path, request(0, "[", "", 0, 0));
+    check(unbalanced.status == ERROR && !unbalanced.error.empty(), "an unbalanced program is not an error");
+    Reply flood = ask(path, request(0, "+[.]", "", 0, 30000));
+    check(flood.status == ERROR && flood.error.find("Output limit") != std::string::npos,
+          "output past the cap is not an error");
+    Reply finished = ask(path, request(0, "-[>-[>-[.-]<-]<-]>>>++++++++++[>++++++++++[>++++++++++[>-[.-]<-]<-]<-]", "", 0, 30000));
+    check(finished.status == ERROR && finished.error.find("Output limit") != std::string::npos,
+          "output past the cap is not an error when the program ends");
+
+    // Several requests on one connection, sent before reading any reply.
+    fd = connectTo(path);
+    std::string batch = request(0, hello.source, "", 0, 0) + request(0, ",[.,]", "one", 0, 0) +
+                        request(0, "+[]", "", 100, 0) + request(0, ",.", "2", 0, 0);
+    bool sent = fd >= 0 && sendAll(fd, batch);
+    Reply r1 = sent ? readReply(fd) : Reply(), r2 = sent ? readReply(fd) : Reply();
+    Reply r3 = sent ? readReply(fd) : Reply(), r4 = sent ? readReply(fd) : Reply();
+    check(r1.output == "Hello World!\n" && r2.output == "one" && r3.status == LIMIT && r4.output == "2",
+          "pipelined replies are wrong or out of order");
+    if (fd >= 0) ::close(fd);
+
+    // A malformed frame loses that connection only.
+    fd = connectTo(path);
+    std::string junk;
+    put32(junk, 3);
+    junk += "bad";
+    if (fd >= 0 && sendAll(fd, junk)) {
+        std::string rest;
+        check(!receive(fd, rest, 1), "a malformed frame is answered");
+    }
+    if (fd >= 0) ::close(fd);
+    std::string huge;
+    put32(huge, 0xffffffffu);
+    Reply after = ask(path, huge);
+    check(!after.ok, "an oversized frame is answered");
+    check(ask(path, request(0, ",.", "x", 0, 0)).output == "x", "the server stops serving after a bad frame");
+
+    kill(pid, SIGTERM);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "does not exit cleanly on SIGTERM");
+    check(access(path.c_str(), F_OK) != 0, "leaves its socket behind");
+    std::cout << "Server" << (isolate ? " (isolated)" : "") << ": " << checks << " protocol checks run\n";
+}
+
+#endif
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " path/to/trbbfi\n";
+        return 2;
+    }
+#ifndef _WIN32
+    char dir_template[] = "/tmp/trbbfi-check-XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        std::cerr << "Error: Cannot create a temporary directory\n";
+        return 2;
+    }
+    std::string dir = dir_template;
+#else
+    std::string dir = ".";
+#endif
+    checkResume();
+    checkBytecode(dir);
+#ifndef _WIN32
+    checkWatchpoints();
+    checkServer(argv[1], dir, false);
+    checkServer(argv[1], dir, true);
+    rmdir(dir.c_str());
+#endif
+    if (failures) {
+        std::cout << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "All checks passed\n";
+    return 0;
+}
@@ -0,0 +1,3826 @@
+/*
+ * TRBBFI - The Really Better Brainfuck Interpreter
+ * Author: TheRealOwenJ
+ * Repository: https://github.com/TheRealOwenJ/trbbfi
+ *
+ * Licensed under GNU GPL v3 to prevent theft.
+ * See LICENSE file for details.
+ */
+
+
+#include "trbbfi.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <csignal>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+namespace trbbfi {
+
+// Compiled form of a program. Commands are lowered one op each and then
+// rewritten by the optimization passes selected with -O or --passes.
+enum class OpCode : uint8_t {
+    Add,            // memory[memptr + offset] += arg
+    Move,           // memptr += arg
+    Guard,          // bounds check for block arg, falls back to code on failure
+    Output,         // write memory[memptr + offset] + arg
+    OutputConst,    // write len bytes of the string pool starting at arg
+    OutputCells,    // write len cells of the cell pool starting at arg
+    Input,          // memory[memptr] = next input byte
+    JumpIfZero,     // if memory[memptr] == 0 jump to arg
+    JumpIfNonZero,  // if memory[memptr] != 0 jump to arg, charging len steps
+    Set,            // memory[memptr + offset] = arg, charging the loop it replaced
+    Mul,            // memory[memptr + offset] += memory[memptr] * arg
+    End,
+    Trap            // breakpoint, only in a Machine's patched copy of the ops
+};
+
+// For a Guard, len is the number of ops it covers. For a JumpIfNonZero it
+// is the cost of one iteration of its loop, and for a Set the packed cost
+// of the loop it replaced (see collapsedCost).
+struct Op {
+    OpCode code;
+    int32_t offset;
+    int32_t arg;
+    uint32_t len;
+};
+
+// Cell written by an OutputCells op, either memory[memptr + offset] + value
+// or, when the compiler knew the cell, the constant value itself.
+struct OutputCell {
+    int32_t offset;
+    uint8_t value;
+    uint8_t constant;
+};
+
+// Positions visited by an offset-addressed block. When the block would step
+// outside the tape it is re-run from its source characters instead, which
+// keeps the pointer clamping and growth rules of the plain interpreter.
+struct Block {
+    int32_t min_offset;
+    int32_t max_offset;
+    uint32_t code_begin;
+    uint32_t code_end;
+    uint32_t end;
+};
+
+static_assert(sizeof(Op) == 16, "Op layout is part of the bytecode format");
+static_assert(sizeof(OutputCell) == 8, "OutputCell layout is part of the bytecode format");
+static_assert(sizeof(Block) == 20, "Block layout is part of the bytecode format");
+
+// Read-only view of a compiled program. It points either into the vectors
+// filled by compile() or straight into a mapped .bfc file.
+struct ProgramImage {
+    const Op* ops = nullptr;
+    size_t op_count = 0;
+    const uint32_t* op_code = nullptr;
+    const Block* blocks = nullptr;
+    size_t block_count = 0;
+    const OutputCell* output_cells = nullptr;
+    size_t output_cell_count = 0;
+    const char* output_strings = nullptr;
+    size_t output_strings_size = 0;
+    const char* code = nullptr;
+    size_t code_size = 0;
+};
+
+// Bytecode (.bfc) file layout: this header followed by the ops, op_code,
+// blocks, output_cells, output_strings and code sections, each padded to 8
+// bytes. Everything is stored in native byte order; the endian field
+// rejects files written on a machine of the other order.
+struct BytecodeHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t endian;
+    uint32_t op_size;
+    uint32_t flags;
+    uint64_t checksum;
+    uint64_t op_count;
+    uint64_t block_count;
+    uint64_t output_cell_count;
+    uint64_t output_strings_size;
+    uint64_t code_size;
+};
+
+static const char BYTECODE_MAGIC[4] = {'T', 'R', 'B', 'C'};
+static const uint16_t BYTECODE_VERSION = 3;
+static const uint16_t BYTECODE_ENDIAN = 0x0102;
+
+// FNV-1a over 64-bit words, so verifying a large file stays cheap.
+static uint64_t bytecodeChecksum(const unsigned char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < size; i++) hash = (hash ^ data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static size_t alignSection(size_t size) { return (size + 7) & ~size_t(7); }
+
+static bool isBytecodeFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[4] = {};
+    return file.read(magic, 4) && std::memcmp(magic, BYTECODE_MAGIC, 4) == 0;
+}
+
+// Read-only mapping of a whole file. Platforms without mmap read the file
+// into memory instead.
+class MappedFile {
+private:
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<unsigned char> buffer;
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) { ::close(fd); return false; }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) { ::close(fd); size_ = 0; return false; }
+            data_ = static_cast<const unsigned char*>(mapped);
+        }
+        ::close(fd);
+        return true;
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data_ = buffer.data();
+        size_ = buffer.size();
+        return true;
+#endif
+    }
+
+    void close() {
+#ifndef _WIN32
+        if (data_ && size_ > 0) munmap(const_cast<unsigned char*>(data_), size_);
+#endif
+        buffer.clear();
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    void swap(MappedFile& other) {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        buffer.swap(other.buffer);
+    }
+
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+// Maps source offsets back to lines and columns. The line index is built on
+// the first lookup, so loading a large file pays nothing for it; a lookup is
+// then a table read plus a scan of at most one chunk.
+class SourceMap {
+private:
+    const char* text = nullptr;
+    size_t size = 0;
+    bool has_lines = false;
+    mutable std::mutex mutex;
+    mutable bool indexed = false;
+    mutable std::vector<uint32_t> chunk_lines;
+    mutable std::vector<uint32_t> chunk_columns;
+
+    void buildIndex() const {
+        chunk_lines.clear();
+        chunk_columns.clear();
+        size_t line = 0, line_start = 0;
+        for (size_t start = 0; start < size; start += CHUNK_SIZE) {
+            chunk_lines.push_back(static_cast<uint32_t>(line));
+            chunk_columns.push_back(static_cast<uint32_t>(start - line_start));
+            size_t end = std::min(start + CHUNK_SIZE, size);
+            const char* p = text + start;
+            while ((p = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(text + end - p))))) {
+                line++;
+                line_start = static_cast<size_t>(++p - text);
+            }
+        }
+        indexed = true;
+    }
+
+public:
+    static constexpr size_t CHUNK_SIZE = 4096;
+
+    static bool isCommand(char c) {
+        return c == '>' || c == '<' || c == '+' || c == '-' ||
+               c == '.' || c == ',' || c == '[' || c == ']';
+    }
+
+    // Programs loaded from bytecode only keep their commands, so they have
+    // no lines and locations fall back to the command index.
+    void reset(const char* data, size_t length, bool lines) {
+        std::lock_guard<std::mutex> lock(mutex);
+        text = data;
+        size = length;
+        has_lines = lines;
+        indexed = false;
+        chunk_lines.clear();
+        chunk_columns.clear();
+    }
+
+    bool hasLines() const { return has_lines; }
+
+    SourceLocation locate(size_t offset) const {
+        if (!has_lines) return {offset, 0, 0};
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!indexed) buildIndex();
+        offset = std::min(offset, size);
+        size_t chunk = offset / CHUNK_SIZE;
+        if (chunk >= chunk_lines.size()) return {offset, chunk_lines.empty() ? 1 : chunk_lines.back() + 1, 1};
+        size_t line = chunk_lines[chunk], column = chunk_columns[chunk];
+        for (size_t i = chunk * CHUNK_SIZE; i < offset; i++) {
+            if (text[i] == '\n') { line++; column = 0; }
+            else column++;
+        }
+        return {offset, line + 1, column + 1};
+    }
+
+    static std::string format(const SourceLocation& loc) {
+        if (loc.line == 0) return "command " + std::to_string(loc.offset);
+        return "line " + std::to_string(loc.line) + ", column " + std::to_string(loc.column);
+    }
+};
+
+// Finds command bytes 64 at a time. Each variant classifies a block into a
+// mask with bit i set when p[i] is a command, so comment runs are skipped a
+// whole block at a time, and compacts a block's commands by its mask. The
+// best variant the CPU supports is picked once, on first use.
+class CommandScanner {
+public:
+    using ClassifyFn = uint64_t (*)(const char* p);
+    // Writes the commands of a 64-byte block to dst and returns how many
+    // there are. May write up to 64 bytes.
+    using CompactFn = size_t (*)(const char* p, uint64_t mask, char* dst);
+
+    struct Variant {
+        const char* name;
+        ClassifyFn classify;
+        CompactFn compact;
+    };
+
+    static uint64_t classifyScalar(const char* p) {
+        uint64_t mask = 0;
+        for (int i = 0; i < 64; i++)
+            if (SourceMap::isCommand(p[i])) mask |= uint64_t(1) << i;
+        return mask;
+    }
+
+    static size_t compactScalar(const char* p, uint64_t mask, char* dst) {
+        char* out = dst;
+        for (; mask; mask &= mask - 1) *out++ = p[lowestBit(mask)];
+        return static_cast<size_t>(out - dst);
+    }
+
+#if defined(__SSE2__)
+    // '+' ',' '-' '.' are 0x2b..0x2e, so one wrapping subtract and an
+    // unsigned range check covers them; '<' and '>' differ only in bit 1.
+    static uint32_t classify16(__m128i x) {
+        __m128i arith = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(x, _mm_set1_epi8(0x2b)), _mm_set1_epi8(3)),
+                                       _mm_setzero_si128());
+        __m128i move = _mm_cmpeq_epi8(_mm_or_si128(x, _mm_set1_epi8(2)), _mm_set1_epi8('>'));
+        __m128i loop = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('[')), _mm_cmpeq_epi8(x, _mm_set1_epi8(']')));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(arith, move), loop)));
+    }
+
+    static uint64_t classifySse2(const char* p) {
+        uint64_t mask = 0;
+        for (int i = 0; i < 4; i++)
+            mask |= uint64_t(classify16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i)))) << (16 * i);
+        return mask;
+    }
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    __attribute__((target("avx2"))) static uint32_t classify32(__m256i x) {
+        __m256i arith = _mm256_cmpeq_epi8(
+            _mm256_subs_epu8(_mm256_sub_epi8(x, _mm256_set1_epi8(0x2b)), _mm256_set1_epi8(3)), _mm256_setzero_si256());
+        __m256i move = _mm256_cmpeq_epi8(_mm256_or_si256(x, _mm256_set1_epi8(2)), _mm256_set1_epi8('>'));
+        __m256i loop =
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('[')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8(']')));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(arith, move), loop)));
+    }
+
+    __attribute__((target("avx2"))) static uint64_t classifyAvx2(const char* p) {
+        uint64_t low = classify32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+        uint64_t high = classify32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32)));
+        return low | high << 32;
+    }
+
+    // For each 8-bit mask, the pshufb indices that gather its set bytes to
+    // the front.
+    static const uint64_t* shuffleTable() {
+        static const std::vector<uint64_t> table = [] {
+            std::vector<uint64_t> rows(256);
+            for (unsigned m = 0; m < 256; m++) {
+                uint64_t row = 0;
+                unsigned k = 0;
+                for (unsigned bit = 0; bit < 8; bit++)
+                    if (m & (1u << bit)) row |= uint64_t(bit) << (8 * k++);
+                rows[m] = row;
+            }
+            return rows;
+        }();
+        return table.data();
+    }
+
+    // Gathers 8 bytes at a time with one shuffle; each store writes all 8
+    // bytes but only advances by the number of commands.
+    __attribute__((target("ssse3"))) static size_t compactShuffle(const char* p, uint64_t mask, char* dst) {
+        const uint64_t* table = shuffleTable();
+        char* out = dst;
+        for (int i = 0; i < 8; i++) {
+            unsigned bits = static_cast<unsigned>(mask >> (8 * i)) & 0xff;
+            if (bits == 0) continue;
+            __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 8 * i));
+            __m128i order = _mm_cvtsi64_si128(static_cast<long long>(table[bits]));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(bytes, order));
+            out += __builtin_popcount(bits);
+        }
+        return static_cast<size_t>(out - dst);
+    }
+#endif
+
+    // Every variant this CPU can run, slowest first.
+    static const std::vector<Variant>& variants() {
+        static const std::vector<Variant> list = [] {
+            std::vector<Variant> found = {{"scalar", classifyScalar, compactScalar}};
+#if defined(__SSE2__)
+            found.push_back({"sse2", classifySse2, compactScalar});
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+            if (__builtin_cpu_supports("ssse3")) found.push_back({"ssse3", classifySse2, compactShuffle});
+            if (__builtin_cpu_supports("avx2")) found.push_back({"avx2", classifyAvx2, compactShuffle});
+#endif
+            return found;
+        }();
+        return list;
+    }
+
+    static const Variant& best() { return variants().back(); }
+
+    static int lowestBit(uint64_t mask) { return __builtin_ctzll(mask); }
+
+    // Mask of the commands in text[base, base + 64), reading past size
+    // through a zeroed copy so the last block never overruns the source.
+    static uint64_t scan(ClassifyFn classify, const char* text, size_t size, size_t base) {
+        if (size - base >= 64) return classify(text + base);
+        char tail[64] = {};
+        std::memcpy(tail, text + base, size - base);
+        return classify(tail);
+    }
+
+    // Appends the commands in text[0, size) to out.
+    static void compact(const Variant& variant, const char* text, size_t size, std::string& out) {
+        size_t used = out.size();
+        out.resize(used + size + 64);
+        char* dst = &out[used];
+        for (size_t base = 0; base < size; base += 64) {
+            char tail[64] = {};
+            const char* block = text + base;
+            if (size - base < 64) {
+                std::memcpy(tail, block, size - base);
+                block = tail;
+            }
+            uint64_t mask = variant.classify(block);
+            if (mask == 0) continue;
+            if (mask == ~uint64_t(0)) {
+                std::memcpy(dst, block, 64);
+                dst += 64;
+            } else {
+                dst += variant.compact(block, mask, dst);
+            }
+        }
+        out.resize(static_cast<size_t>(dst - out.data()));
+    }
+};
+
+struct Program::Impl {
+    std::string owned_source;
+    std::vector<Op> ops;
+    std::vector<uint32_t> op_code;
+    std::vector<Block> blocks;
+    std::vector<OutputCell> output_cells;
+    std::string output_strings;
+    ProgramImage image;
+    MappedFile mapping;
+    SourceMap source_map;
+    CompileOptions compile_options;
+    size_t command_count = 0;
+    bool first_segment = true;
+    bool entry_zero = true;
+    mutable std::string error;
+
+    static constexpr size_t SEGMENT_SIZE = 1 << 20;
+
+    // Cell values known at compile time. Keys are positions relative to the
+    // pointer at program start; -1 marks a cell that is known to be unknown.
+    struct KnownCells {
+        std::map<int64_t, int> values;
+        int64_t base = 0;
+        bool rest_zero = true;
+
+        int get(int64_t pos) const {
+            auto it = values.find(pos);
+            if (it != values.end()) return it->second;
+            return rest_zero ? 0 : -1;
+        }
+
+        void forget() {
+            values.clear();
+            rest_zero = false;
+        }
+    };
+
+    void emit(const Op& op, size_t code_index) {
+        ops.push_back(op);
+        op_code.push_back(static_cast<uint32_t>(code_index));
+    }
+
+    // Each pass rewrites ops and op_code; they start by taking the current
+    // IR out of the members and then emit the new one.
+    void takeIR(std::vector<Op>& in, std::vector<uint32_t>& in_code) {
+        in.swap(ops);
+        in_code.swap(op_code);
+        ops.clear();
+        op_code.clear();
+        ops.reserve(in.size());
+        op_code.reserve(in.size());
+    }
+
+    // Copies the guard at in[i] and the ops it covers, returning the index
+    // after them.
+    size_t copyGuarded(const std::vector<Op>& in, const std::vector<uint32_t>& in_code, size_t i) {
+        size_t end = i + 1 + in[i].len;
+        for (; i < end; i++) emit(in[i], in_code[i]);
+        return end;
+    }
+
+    // Lowers the next segment of source starting at pos, one op per run of
+    // the same command, read straight from the source so no filtered copy
+    // is made. A segment ends at the first top-level point after
+    // SEGMENT_SIZE bytes and is closed with an End op whose source offset
+    // is where the next segment starts.
+    bool lowerSegment(const char* text, size_t size, size_t& pos) {
+        ops.clear();
+        op_code.clear();
+        size_t start = pos, depth = 0, end = size;
+        char run = 0;
+        // Commands directly inside each open loop, for its iteration cost.
+        std::vector<uint32_t> direct;
+        CommandScanner::ClassifyFn classify = CommandScanner::best().classify;
+        for (size_t base = pos; base < size && end == size; base += 64) {
+            for (uint64_t mask = CommandScanner::scan(classify, text, size, base); mask; mask &= mask - 1) {
+                size_t i = base + static_cast<size_t>(CommandScanner::lowestBit(mask));
+                char c = text[i];
+                if (depth == 0 && i - start >= SEGMENT_SIZE) { end = i; break; }
+                command_count++;
+                if (c != ']' && !direct.empty()) direct.back()++;
+                if (c == run && (c == '+' || c == '-')) {
+                    ops.back().arg = (ops.back().arg + (c == '+' ? 1 : 255)) & 0xff;
+                    continue;
+                }
+                if (c == run && (c == '>' || c == '<') && std::abs(ops.back().arg) < INT32_MAX / 2) {
+                    ops.back().arg += c == '>' ? 1 : -1;
+                    continue;
+                }
+                run = c;
+                switch (c) {
+                    case '+': emit({OpCode::Add, 0, 1, 0}, i); break;
+                    case '-': emit({OpCode::Add, 0, 255, 0}, i); break;
+                    case '>': emit({OpCode::Move, 0, 1, 0}, i); break;
+                    case '<': emit({OpCode::Move, 0, -1, 0}, i); break;
+                    case '.': emit({OpCode::Output, 0, 0, 0}, i); break;
+                    case ',': emit({OpCode::Input, 0, 0, 0}, i); break;
+                    case '[':
+                        emit({OpCode::JumpIfZero, 0, 0, 0}, i);
+                        direct.push_back(0);
+                        depth++;
+                        break;
+                    case ']':
+                        if (depth == 0) return false;
+                        emit({OpCode::JumpIfNonZero, 0, 0, direct.back() + 1}, i);
+                        direct.pop_back();
+                        depth--;
+                        break;
+                }
+            }
+        }
+        pos = end;
+        emit({OpCode::End, 0, 0, 0}, end);
+        return linkJumps();
+    }
+
+    // Points each bracket just past its partner and each guard's block at
+    // the end of the ops it covers.
+    bool linkJumps() {
+        std::vector<size_t> open;
+        for (size_t i = 0; i < ops.size(); i++) {
+            if (ops[i].code == OpCode::JumpIfZero) {
+                open.push_back(i);
+            } else if (ops[i].code == OpCode::JumpIfNonZero) {
+                if (open.empty()) return false;
+                size_t start = open.back();
+                open.pop_back();
+                ops[start].arg = static_cast<int32_t>(i + 1);
+                ops[i].arg = static_cast<int32_t>(start + 1);
+            } else if (ops[i].code == OpCode::Guard) {
+                blocks[static_cast<size_t>(ops[i].arg)].end = static_cast<uint32_t>(i + 1 + ops[i].len);
+            }
+        }
+        return open.empty();
+    }
+
+    // fold: merges runs of + and - on the same cell and runs of moves in
+    // the same direction. Opposite moves are left alone because moving left
+    // clamps at cell 0.
+    void foldPass() {
+        std::vector<Op> in;
+        std::vector<uint32_t> in_code;
+        takeIR(in, in_code);
+        for (size_t i = 0; i < in.size();) {
+            Op op = in[i];
+            if (op.code == OpCode::Guard) { i = copyGuarded(in, in_code, i); continue; }
+            size_t j = i + 1;
+            if (op.code == OpCode::Add) {
+                for (; j < in.size() && in[j].code == OpCode::Add && in[j].offset == op.offset; j++)
+                    op.arg = (op.arg + in[j].arg) & 0xff;
+                if (op.arg != 0) emit(op, in_code[i]);
+            } else if (op.code == OpCode::Move) {
+                for (; j < in.size() && in[j].code == OpCode::Move && (in[j].arg < 0) == (op.arg < 0) &&
+                       std::abs(static_cast<int64_t>(op.arg) + in[j].arg) <= INT32_MAX; j++)
+                    op.arg += in[j].arg;
+                if (op.arg != 0) emit(op, in_code[i]);
+            } else {
+                emit(op, in_code[i]);
+            }
+            i = j;
+        }
+        linkJumps();
+    }
+
+    // dce: drops loops whose cell is known to be zero when they are
+    // reached, such as comment loops at the start of a program or loops
+    // directly after another loop.
+    void dcePass() {
+        std::vector<Op> in;
+        std::vector<uint32_t> in_code;
+        takeIR(in, in_code);
+        for (size_t i = 0; i < in.size();) {
+            const Op& op = in[i];
+            if (op.code == OpCode::Guard) { i = copyGuarded(in, in_code, i); continue; }
+            bool zero = ops.empty() ? entry_zero : ops.back().code == OpCode::JumpIfNonZero ||
+                        (ops.back().code == OpCode::Set && ops.back().offset == 0 && ops.back().arg == 0);
+            if (op.code == OpCode::JumpIfZero && zero) {
+                i = static_cast<size_t>(op.arg);
+                continue;
+            }
+            emit(op, in_code[i]);
+            i++;
+        }
+        linkJumps();
+    }
+
+    // clear: turns [-] and friends into a single Set. Any odd step reaches
+    // zero, so the loop always ends with the cell cleared.
+    void clearPass() {
+        std::vector<Op> in;
+        std::vector<uint32_t> in_code;
+        takeIR(in, in_code);
+        for (size_t i = 0; i < in.size();) {
+            if (in[i].code == OpCode::Guard) { i = copyGuarded(in, in_code, i); continue; }
+            if (in[i].code == OpCode::JumpIfZero && i + 2 < in.size() &&
+                in[i + 1].code == OpCode::Add && in[i + 1].offset == 0 && (in[i + 1].arg & 1) &&
+                in[i + 2].code == OpCode::JumpIfNonZero) {
+                uint32_t cost = collapsedCost(in[i + 2].len, in[i + 1].arg);
+                if (cost != 0) {
+                    emit({OpCode::Set, 0, 0, cost}, in_code[i]);
+                    i += 3;
+                    continue;
+                }
+            }
+            emit(in[i], in_code[i]);
+            i++;
+        }
+        linkJumps();
+    }
+
+    // mul: turns balanced loops that only add, and step their own cell by
+    // one, into a Mul per target cell followed by a Set.
+    void mulPass() {
+        std::vector<Op> in;
+        std::vector<uint32_t> in_code;
+        takeIR(in, in_code);
+        for (size_t i = 0; i < in.size();) {
+            if (in[i].code == OpCode::Guard) { i = copyGuarded(in, in_code, i); continue; }
+            if (in[i].code == OpCode::JumpIfZero && emitMulLoop(in, in_code, i)) {
+                i = static_cast<size_t>(in[i].arg);
+                continue;
+            }
+            emit(in[i], in_code[i]);
+            i++;
+        }
+        linkJumps();
+    }
+
+    bool emitMulLoop(const std::vector<Op>& in, const std::vector<uint32_t>& in_code, size_t start) {
+        size_t close = static_cast<size_t>(in[start].arg) - 1;
+        std::map<int32_t, int> deltas;
+        int64_t rel = 0, min_offset = 0, max_offset = 0;
+        for (size_t k = start + 1; k < close; k++) {
+            const Op& op = in[k];
+            if (op.code == OpCode::Add) deltas[static_cast<int32_t>(rel + op.offset)] += op.arg;
+            else if (op.code == OpCode::Move) rel += op.arg;
+            else return false;
+            min_offset = std::min(min_offset, rel + std::min(op.offset, 0));
+            max_offset = std::max(max_offset, rel + std::max(op.offset, 0));
+            if (max_offset - min_offset > INT32_MAX / 2) return false;
+        }
+        int step = deltas.count(0) ? deltas[0] & 0xff : 0;
+        if (rel != 0 || (step != 1 && step != 255)) return false;
+        uint32_t cost = collapsedCost(in[close].len, step);
+        if (cost == 0) return false;
+
+        std::vector<Op> muls;
+        for (const auto& d : deltas) {
+            int factor = d.second & 0xff;
+            if (d.first == 0 || factor == 0) continue;
+            // Stepping up by one runs 256 - value times, i.e. -value.
+            if (step == 1) factor = (256 - factor) & 0xff;
+            muls.push_back({OpCode::Mul, d.first, factor, 0});
+        }
+        // A loop that moves needs the guard even with nothing to multiply:
+        // run from the source it may step off the tape or grow it.
+        if (!muls.empty() || min_offset < 0 || max_offset > 0) {
+            size_t block_index = blocks.size();
+            blocks.push_back({static_cast<int32_t>(min_offset), static_cast<int32_t>(max_offset),
+                              in_code[start], in_code[close] + 1, 0});
+            emit({OpCode::Guard, 0, static_cast<int32_t>(block_index), static_cast<uint32_t>(muls.size() + 1)},
+                 in_code[start]);
+            for (const auto& mul : muls) emit(mul, in_code[start]);
+        }
+        emit({OpCode::Set, 0, 0, cost}, in_code[start]);
+        return true;
+    }
+
+    // A loop stepping its cell by an odd step runs (cell * k) & 0xff times,
+    // where k is minus the inverse of step mod 256. Its Set charges that
+    // many iterations: len packs the iteration cost above k. Returns 0 when
+    // the cost does not fit, and the loop is then left alone.
+    static uint32_t collapsedCost(uint32_t iteration_cost, int step) {
+        if (iteration_cost >= (1u << 24)) return 0;
+        unsigned inverse = 1;
+        for (int k = 0; k < 7; k++) inverse = (inverse * (2 - static_cast<unsigned>(step) * inverse)) & 0xff;
+        return iteration_cost << 8 | ((256 - inverse) & 0xff);
+    }
+
+    // block: compiles each straight run of Add, Move and Output into an
+    // offset-addressed block. Outputs are gathered into one op, or a
+    // constant string when every byte is known at compile time.
+    void blockPass() {
+        std::vector<Op> in;
+        std::vector<uint32_t> in_code;
+        takeIR(in, in_code);
+        KnownCells known;
+        if (!first_segment) known.forget();
+        for (size_t i = 0; i < in.size();) {
+            const Op& op = in[i];
+            switch (op.code) {
+                case OpCode::Add:
+                case OpCode::Move:
+                case OpCode::Output:
+                    i = compileBlock(in, in_code, i, known);
+                    continue;
+                case OpCode::Guard:
+                    known.forget();
+                    i = copyGuarded(in, in_code, i);
+                    continue;
+                case OpCode::JumpIfZero:
+                    known.forget();
+                    break;
+                case OpCode::JumpIfNonZero:
+                    known.forget();
+                    known.values[known.base] = 0;
+                    break;
+                case OpCode::Input:
+                    known.values[known.base + op.offset] = -1;
+                    break;
+                case OpCode::Set:
+                    known.values[known.base + op.offset] = op.arg & 0xff;
+                    break;
+                default:
+                    break;
+            }
+            emit(op, in_code[i]);
+            i++;
+        }
+        linkJumps();
+    }
+
+    size_t compileBlock(const std::vector<Op>& in, const std::vector<uint32_t>& in_code,
+                        size_t begin, KnownCells& known) {
+        std::map<int32_t, int> deltas;
+        std::vector<OutputCell> outputs;
+        int64_t rel = 0, min_offset = 0, max_offset = 0;
+        bool moved = false, offset_access = false;
+
+        size_t i = begin;
+        for (; i < in.size(); i++) {
+            const Op& op = in[i];
+            if (op.code != OpCode::Add && op.code != OpCode::Move && op.code != OpCode::Output) break;
+            if (op.code == OpCode::Move) {
+                if (std::abs(rel + op.arg) > INT32_MAX / 2) break;
+                rel += op.arg;
+                min_offset = std::min(min_offset, rel);
+                max_offset = std::max(max_offset, rel);
+                moved = true;
+                continue;
+            }
+            int32_t cell = static_cast<int32_t>(rel + op.offset);
+            min_offset = std::min<int64_t>(min_offset, cell);
+            max_offset = std::max<int64_t>(max_offset, cell);
+            offset_access |= moved || cell != 0;
+            if (op.code == OpCode::Add) {
+                deltas[cell] += op.arg;
+            } else {
+                int delta = (deltas.count(cell) ? deltas[cell] : 0) + op.arg;
+                int value = known.get(known.base + cell);
+                if (value >= 0) outputs.push_back({cell, static_cast<uint8_t>((value + delta) & 0xff), 1});
+                else outputs.push_back({cell, static_cast<uint8_t>(delta & 0xff), 0});
+            }
+        }
+        size_t code_begin = in_code[begin], code_end = in_code[i];
+
+        // Accesses before any move and a trailing one-way move are safe on
+        // their own; anything else could be clamped or grow the tape midway.
+        bool guarded = offset_access || min_offset < std::min<int64_t>(rel, 0) ||
+                       max_offset > std::max<int64_t>(rel, 0);
+        size_t guard = ops.size();
+        if (guarded) {
+            emit({OpCode::Guard, 0, static_cast<int32_t>(blocks.size()), 0}, code_begin);
+            blocks.push_back({static_cast<int32_t>(min_offset), static_cast<int32_t>(max_offset),
+                              static_cast<uint32_t>(code_begin), static_cast<uint32_t>(code_end), 0});
+        }
+
+        if (outputs.size() == 1 && !outputs[0].constant) {
+            emit({OpCode::Output, outputs[0].offset, outputs[0].value, 0}, code_begin);
+        } else if (!outputs.empty()) {
+            bool all_constant = std::all_of(outputs.begin(), outputs.end(),
+                                            [](const OutputCell& cell) { return cell.constant != 0; });
+            if (all_constant) {
+                emit({OpCode::OutputConst, 0, static_cast<int32_t>(output_strings.size()),
+                      static_cast<uint32_t>(outputs.size())}, code_begin);
+                for (const auto& cell : outputs) output_strings.push_back(static_cast<char>(cell.value));
+            } else {
+                emit({OpCode::OutputCells, 0, static_cast<int32_t>(output_cells.size()),
+                      static_cast<uint32_t>(outputs.size())}, code_begin);
+                output_cells.insert(output_cells.end(), outputs.begin(), outputs.end());
+            }
+        }
+
+        for (const auto& d : deltas) {
+            int delta = d.second & 0xff;
+            if (delta != 0) emit({OpCode::Add, d.first, delta, 0}, code_begin);
+        }
+        if (rel != 0) emit({OpCode::Move, 0, static_cast<int32_t>(rel), 0}, code_begin);
+        if (guarded) ops[guard].len = static_cast<uint32_t>(ops.size() - guard - 1);
+
+        // A block that steps left may be clamped at cell 0 at run time, after
+        // which positions relative to program start no longer hold.
+        if (min_offset < 0 && !(known.rest_zero && known.base + min_offset >= 0)) {
+            known.forget();
+        } else {
+            for (const auto& d : deltas) {
+                int value = known.get(known.base + d.first);
+                known.values[known.base + d.first] = value >= 0 ? (value + d.second) & 0xff : -1;
+            }
+        }
+        known.base += rel;
+        return i;
+    }
+
+    struct PassInfo {
+        const char* name;
+        void (Impl::*run)();
+    };
+
+    static const std::vector<PassInfo>& passRegistry() {
+        static const std::vector<PassInfo> passes = {
+            {"fold", &Impl::foldPass},
+            {"dce", &Impl::dcePass},
+            {"clear", &Impl::clearPass},
+            {"mul", &Impl::mulPass},
+            {"block", &Impl::blockPass},
+        };
+        return passes;
+    }
+
+    static std::vector<std::string> levelPasses(int level) {
+        switch (level) {
+            case 0: return {};
+            case 1: return {"fold"};
+            case 2: return {"fold", "clear", "block"};
+            default: return {"fold", "dce", "clear", "mul", "block"};
+        }
+    }
+
+    // Compiles the source a segment at a time: each segment is lowered and
+    // run through every pass before the next one is read, so working memory
+    // stays bounded by the segment size on top of the finished IR.
+    bool compile(const char* text, size_t size) {
+        using Clock = std::chrono::steady_clock;
+        std::vector<std::string> pipeline = compile_options.passes.empty()
+            ? levelPasses(compile_options.opt_level) : compile_options.passes;
+        std::vector<std::string> stages = {"lower"};
+        stages.insert(stages.end(), pipeline.begin(), pipeline.end());
+        std::vector<double> stage_ms(stages.size(), 0.0);
+        std::vector<size_t> stage_ops(stages.size(), 0);
+
+        std::vector<Op> program;
+        std::vector<uint32_t> program_code;
+        blocks.clear();
+        output_cells.clear();
+        output_strings.clear();
+        command_count = 0;
+        auto total = Clock::now();
+        size_t pos = 0, segment = 0;
+        do {
+            first_segment = segment == 0;
+            entry_zero = program.empty() || program.back().code == OpCode::JumpIfNonZero ||
+                         (program.back().code == OpCode::Set && program.back().offset == 0 &&
+                          program.back().arg == 0);
+            bool multi = pos > 0 || size - pos > SEGMENT_SIZE;
+            for (size_t k = 0; k < stages.size(); k++) {
+                auto start = Clock::now();
+                if (k == 0) {
+                    if (!lowerSegment(text, size, pos)) return false;
+                } else {
+                    for (const auto& pass : passRegistry())
+                        if (stages[k] == pass.name) (this->*pass.run)();
+                }
+                stage_ms[k] += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+                stage_ops[k] += ops.size() - 1;
+                if (compile_options.dump_ir && compile_options.dump_after == stages[k]) {
+                    std::cerr << "*** IR after " << stages[k];
+                    if (multi) std::cerr << " (segment " << segment << ")";
+                    std::cerr << " ***\n";
+                    dumpIR(std::cerr);
+                }
+            }
+            // Every segment but the last drops its closing End.
+            size_t keep = pos < size ? ops.size() - 1 : ops.size();
+            program.insert(program.end(), ops.begin(), ops.begin() + static_cast<std::ptrdiff_t>(keep));
+            program_code.insert(program_code.end(), op_code.begin(), op_code.begin() + static_cast<std::ptrdiff_t>(keep));
+            segment++;
+        } while (pos < size);
+
+        ops.swap(program);
+        op_code.swap(program_code);
+        std::vector<Op>().swap(program);
+        std::vector<uint32_t>().swap(program_code);
+        if (!linkJumps()) return false;
+
+        if (compile_options.time_passes) {
+            std::fprintf(stderr, "Pass timings (%zu source bytes, %zu segments):\n", size, segment);
+            for (size_t k = 0; k < stages.size(); k++)
+                std::fprintf(stderr, "  %-8s %10.3f ms %10zu ops\n", stages[k].c_str(), stage_ms[k], stage_ops[k]);
+            double ms = std::chrono::duration<double, std::milli>(Clock::now() - total).count();
+            std::fprintf(stderr, "  %-8s %10.3f ms %10zu ops\n", "total", ms, ops.size());
+        }
+        if (compile_options.dump_ir && compile_options.dump_after.empty()) {
+            std::cerr << "*** IR after total ***\n";
+            dumpIR(std::cerr);
+        }
+        return true;
+    }
+
+    void bindImage(const char* text, size_t size) {
+        image.ops = ops.data();
+        image.op_count = ops.size();
+        image.op_code = op_code.data();
+        image.blocks = blocks.data();
+        image.block_count = blocks.size();
+        image.output_cells = output_cells.data();
+        image.output_cell_count = output_cells.size();
+        image.output_strings = output_strings.data();
+        image.output_strings_size = output_strings.size();
+        image.code = text;
+        image.code_size = size;
+    }
+
+    bool compileSource(const char* text, size_t size) {
+        error.clear();
+        if (size > UINT32_MAX) {
+            ops.clear();
+            bindImage(text, 0);
+            return fail("Program too large (4GB limit)");
+        }
+        source_map.reset(text, size, true);
+        bool ok = compile(text, size);
+        if (!ok) ops.clear();
+        bindImage(text, size);
+        if (ok) return true;
+        size_t unmatched = findUnmatchedBracket();
+        if (unmatched == size) return fail("Program failed to compile");
+        return fail(std::string("Unmatched '") + text[unmatched] + "' at " +
+                    SourceMap::format(source_map.locate(unmatched)));
+    }
+
+    bool fail(const std::string& message) const {
+        error = message;
+        return false;
+    }
+
+    // Checks everything the dispatch loop trusts: jump pairing, pool ranges,
+    // and that every offset-addressed access sits behind a guard covering it.
+    // The guard fallback runs a block's source, so its brackets must match.
+    static bool balanced(const char* code, size_t begin, size_t end) {
+        size_t depth = 0;
+        for (size_t i = begin; i < end; i++) {
+            if (code[i] == '[') depth++;
+            if (code[i] == ']' && depth-- == 0) return false;
+        }
+        return depth == 0;
+    }
+
+    bool verifyImage(const ProgramImage& img) const {
+        if (img.op_count == 0 || img.ops[img.op_count - 1].code != OpCode::End)
+            return fail("Bytecode does not end with an End op");
+
+        size_t guard_end = 0;
+        int32_t guard_min = 0, guard_max = 0;
+        bool moved = false;
+        for (size_t i = 0; i < img.op_count; i++) {
+            const Op& op = img.ops[i];
+            if (img.op_code[i] > img.code_size) return fail("Bytecode source index out of range");
+            if (op.code > OpCode::End) return fail("Bytecode has an invalid opcode");
+            // Stepping and coverage find the loop of a jump or Set at its bracket.
+            if ((op.code == OpCode::JumpIfZero || op.code == OpCode::JumpIfNonZero || op.code == OpCode::Set) &&
+                (img.op_code[i] >= img.code_size ||
+                 img.code[img.op_code[i]] != (op.code == OpCode::JumpIfNonZero ? ']' : '[')))
+                return fail("Bytecode has a loop op off its bracket");
+
+            bool guarded = i < guard_end;
+            auto covered = [&](int32_t offset) {
+                return offset == 0 || (guarded && !moved && offset >= guard_min && offset <= guard_max);
+            };
+            switch (op.code) {
+                case OpCode::Add:
+                case OpCode::Output:
+                case OpCode::Set:
+                case OpCode::Mul:
+                    if (!covered(op.offset)) return fail("Bytecode has an unguarded cell offset");
+                    break;
+                case OpCode::Move:
+                    if (op.arg == INT32_MIN) return fail("Bytecode has an invalid move");
+                    moved = guarded;
+                    break;
+                case OpCode::Guard:
+                {
+                    if (guarded || static_cast<size_t>(op.arg) >= img.block_count)
+                        return fail("Bytecode has an invalid guard");
+                    const Block& block = img.blocks[op.arg];
+                    if (block.min_offset > 0 || block.min_offset == INT32_MIN || block.max_offset < 0 || block.end <= i ||
+                        block.end >= img.op_count || block.code_begin > block.code_end ||
+                        block.code_end > img.code_size || !balanced(img.code, block.code_begin, block.code_end))
+                        return fail("Bytecode has an invalid block");
+                    guard_end = block.end;
+                    guard_min = block.min_offset;
+                    guard_max = block.max_offset;
+                    moved = false;
+                    break;
+                }
+                case OpCode::OutputConst:
+                    if (op.arg < 0 || static_cast<size_t>(op.arg) + op.len > img.output_strings_size)
+                        return fail("Bytecode output string out of range");
+                    break;
+                case OpCode::OutputCells:
+                    if (op.arg < 0 || static_cast<size_t>(op.arg) + op.len > img.output_cell_count)
+                        return fail("Bytecode output cells out of range");
+                    for (uint32_t k = 0; k < op.len; k++) {
+                        const OutputCell& cell = img.output_cells[static_cast<size_t>(op.arg) + k];
+                        if (cell.constant > 1) return fail("Bytecode has an invalid output cell");
+                        if (!cell.constant && !covered(cell.offset))
+                            return fail("Bytecode has an unguarded cell offset");
+                    }
+                    break;
+                case OpCode::JumpIfZero:
+                case OpCode::JumpIfNonZero:
+                {
+                    // Each bracket must jump just past its partner, and the
+                    // partner must jump just past it.
+                    OpCode partner = op.code == OpCode::JumpIfZero ? OpCode::JumpIfNonZero : OpCode::JumpIfZero;
+                    size_t target = static_cast<size_t>(op.arg);
+                    if (guarded || op.arg <= 0 || target >= img.op_count ||
+                        img.ops[target - 1].code != partner ||
+                        static_cast<size_t>(img.ops[target - 1].arg) != i + 1 ||
+                        (op.code == OpCode::JumpIfZero) != (target > i))
+                        return fail("Bytecode has an invalid jump");
+                    break;
+                }
+                case OpCode::Input:
+                case OpCode::End:
+                    if (guarded) return fail("Bytecode has I/O inside a guarded block");
+                    break;
+                case OpCode::Trap:
+                    break;
+            }
+        }
+        return true;
+    }
+
+    // Prints the IR one op per line with its source location.
+    void dumpIR(std::ostream& os) const {
+        static const char* const names[] = {
+            "add", "move", "guard", "out", "out.const", "out.cells", "in",
+            "jz", "jnz", "set", "mul", "end", "trap"};
+        auto cell = [](int32_t offset) {
+            return "[" + std::string(offset >= 0 ? "+" : "") + std::to_string(offset) + "]";
+        };
+        for (size_t i = 0; i < ops.size(); i++) {
+            const Op& op = ops[i];
+            std::string operands;
+            switch (op.code) {
+                case OpCode::Add:
+                case OpCode::Set:
+                case OpCode::Mul:
+                case OpCode::Output:
+                    operands = cell(op.offset) + " " + std::to_string(op.arg);
+                    break;
+                case OpCode::Move:
+                    operands = std::to_string(op.arg);
+                    break;
+                case OpCode::Guard:
+                {
+                    const Block& block = blocks[static_cast<size_t>(op.arg)];
+                    operands = "[" + std::to_string(block.min_offset) + ".." + std::to_string(block.max_offset) +
+                               "] covers " + std::to_string(op.len);
+                    break;
+                }
+                case OpCode::OutputConst:
+                    operands = "\"";
+                    for (char c : output_strings.substr(static_cast<size_t>(op.arg), op.len)) {
+                        if (c >= 32 && c < 127 && c != '"' && c != '\\') operands += c;
+                        else {
+                            char escaped[8];
+                            std::snprintf(escaped, sizeof(escaped), "\\x%02x", static_cast<unsigned char>(c));
+                            operands += escaped;
+                        }
+                    }
+                    operands += "\"";
+                    break;
+                case OpCode::OutputCells:
+                    for (uint32_t k = 0; k < op.len; k++) {
+                        const OutputCell& out = output_cells[static_cast<size_t>(op.arg) + k];
+                        if (k) operands += " ";
+                        operands += out.constant ? std::to_string(out.value)
+                                                 : cell(out.offset) + "+" + std::to_string(out.value);
+                    }
+                    break;
+                case OpCode::JumpIfZero:
+                    operands = "-> " + std::to_string(op.arg);
+                    break;
+                case OpCode::JumpIfNonZero:
+                    operands = "-> " + std::to_string(op.arg) + " cost " + std::to_string(op.len);
+                    break;
+                default:
+                    break;
+            }
+            if (op.code == OpCode::Set && op.len)
+                operands += " cost " + std::to_string(op.len >> 8) + " x" + std::to_string(op.len & 0xff);
+            char line[64];
+            std::snprintf(line, sizeof(line), "%6zu  %-9s ", i, names[static_cast<int>(op.code)]);
+            os << line << operands << "  ; " << SourceMap::format(source_map.locate(op_code[i])) << "\n";
+        }
+    }
+
+
+    // Maps the file and compiles it in place: bytecode runs as is, source is
+    // lowered in one pass over the mapping without being copied. The new
+    // file is mapped and compiled apart from this program, which a failed
+    // load leaves as it was.
+    bool load(const std::string& path) {
+        if (isBytecodeFile(path)) return loadBytecode(path);
+        MappedFile file;
+        if (!file.open(path)) return fail("Cannot open " + path);
+        const char* text = reinterpret_cast<const char*>(file.data());
+        Impl loaded;
+        loaded.compile_options = compile_options;
+        if (!loaded.compileSource(text, file.size())) return fail(loaded.error);
+        mapping.swap(file);
+        owned_source.clear();
+        ops.swap(loaded.ops);
+        op_code.swap(loaded.op_code);
+        blocks.swap(loaded.blocks);
+        output_cells.swap(loaded.output_cells);
+        output_strings.swap(loaded.output_strings);
+        command_count = loaded.command_count;
+        error.clear();
+        source_map.reset(text, mapping.size(), true);
+        bindImage(text, mapping.size());
+        return true;
+    }
+
+
+    bool saveBytecode(const std::string& path) const {
+        if (image.op_count == 0) return fail("No valid program to save");
+
+        std::string payload;
+        auto append = [&payload](const void* data, size_t size) {
+            payload.append(static_cast<const char*>(data), size);
+            payload.resize(alignSection(payload.size()), '\0');
+        };
+        // Copy element by element so padding bytes are zero and the
+        // checksum is reproducible.
+        std::vector<Op> clean_ops(image.op_count);
+        for (size_t i = 0; i < image.op_count; i++) {
+            std::memset(&clean_ops[i], 0, sizeof(Op));
+            clean_ops[i].code = image.ops[i].code;
+            clean_ops[i].offset = image.ops[i].offset;
+            clean_ops[i].arg = image.ops[i].arg;
+            clean_ops[i].len = image.ops[i].len;
+        }
+        // Only the commands are stored, so source offsets are remapped to
+        // command indices in one sweep over the source, compacting the
+        // commands between consecutive positions.
+        std::vector<uint32_t> positions(image.op_code, image.op_code + image.op_count);
+        for (size_t i = 0; i < image.block_count; i++) {
+            positions.push_back(image.blocks[i].code_begin);
+            positions.push_back(image.blocks[i].code_end);
+        }
+        std::sort(positions.begin(), positions.end());
+        positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+        std::vector<uint32_t> indices(positions.size());
+        std::string commands;
+        for (size_t k = 0, done = 0; k <= positions.size(); k++) {
+            size_t next = k < positions.size() ? std::min<size_t>(positions[k], image.code_size) : image.code_size;
+            CommandScanner::compact(CommandScanner::best(), image.code + done, next - done, commands);
+            done = next;
+            if (k < positions.size()) indices[k] = static_cast<uint32_t>(commands.size());
+        }
+        auto remap = [&](uint32_t offset) {
+            return indices[static_cast<size_t>(std::lower_bound(positions.begin(), positions.end(), offset) -
+                                               positions.begin())];
+        };
+        std::vector<uint32_t> clean_code(image.op_count);
+        for (size_t i = 0; i < image.op_count; i++) clean_code[i] = remap(image.op_code[i]);
+        std::vector<Block> clean_blocks(image.blocks, image.blocks + image.block_count);
+        for (auto& block : clean_blocks) {
+            block.code_begin = remap(block.code_begin);
+            block.code_end = remap(block.code_end);
+        }
+
+        std::vector<OutputCell> clean_cells(image.output_cell_count);
+        for (size_t i = 0; i < image.output_cell_count; i++) {
+            std::memset(&clean_cells[i], 0, sizeof(OutputCell));
+            clean_cells[i].offset = image.output_cells[i].offset;
+            clean_cells[i].value = image.output_cells[i].value;
+            clean_cells[i].constant = image.output_cells[i].constant;
+        }
+        append(clean_ops.data(), image.op_count * sizeof(Op));
+        append(clean_code.data(), image.op_count * sizeof(uint32_t));
+        append(clean_blocks.data(), image.block_count * sizeof(Block));
+        append(clean_cells.data(), image.output_cell_count * sizeof(OutputCell));
+        append(image.output_strings, image.output_strings_size);
+        append(commands.data(), commands.size());
+
+        BytecodeHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, BYTECODE_MAGIC, 4);
+        header.version = BYTECODE_VERSION;
+        header.endian = BYTECODE_ENDIAN;
+        header.op_size = sizeof(Op);
+        header.checksum = bytecodeChecksum(reinterpret_cast<const unsigned char*>(payload.data()), payload.size());
+        header.op_count = image.op_count;
+        header.block_count = image.block_count;
+        header.output_cell_count = image.output_cell_count;
+        header.output_strings_size = image.output_strings_size;
+        header.code_size = commands.size();
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) return fail("Cannot open " + path + " for writing");
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+        if (!file) return fail("Cannot write " + path);
+        return true;
+    }
+
+    // Maps a .bfc file and runs it in place; nothing is parsed or copied.
+    // The file is checked before this program is touched, so one that
+    // fails leaves it as it was.
+    bool loadBytecode(const std::string& path) {
+        MappedFile file;
+        if (!file.open(path)) return fail("Cannot open " + path);
+
+        const unsigned char* data = file.data();
+        size_t size = file.size();
+        BytecodeHeader header;
+        if (size < sizeof(header)) return fail("Bytecode file is truncated");
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, BYTECODE_MAGIC, 4) != 0) return fail("Not a bytecode file");
+        if (header.version != BYTECODE_VERSION) return fail("Unsupported bytecode version " + std::to_string(header.version));
+        if (header.endian != BYTECODE_ENDIAN || header.op_size != sizeof(Op))
+            return fail("Bytecode was written for a different architecture");
+
+        // Section sizes are checked one at a time so huge counts cannot overflow.
+        const uint64_t limit = size - sizeof(header);
+        uint64_t sections[6][2] = {
+            {header.op_count, sizeof(Op)}, {header.op_count, sizeof(uint32_t)},
+            {header.block_count, sizeof(Block)}, {header.output_cell_count, sizeof(OutputCell)},
+            {header.output_strings_size, 1}, {header.code_size, 1}};
+        size_t offsets[6];
+        uint64_t pos = 0;
+        for (int k = 0; k < 6; k++) {
+            if (sections[k][0] > limit / sections[k][1]) return fail("Bytecode file is truncated");
+            offsets[k] = static_cast<size_t>(sizeof(header) + pos);
+            pos = alignSection(static_cast<size_t>(pos + sections[k][0] * sections[k][1]));
+            if (pos > limit) return fail("Bytecode file is truncated");
+        }
+        if (bytecodeChecksum(data + sizeof(header), static_cast<size_t>(pos)) != header.checksum)
+            return fail("Bytecode checksum mismatch");
+
+        ProgramImage img;
+        img.ops = reinterpret_cast<const Op*>(data + offsets[0]);
+        img.op_count = static_cast<size_t>(header.op_count);
+        img.op_code = reinterpret_cast<const uint32_t*>(data + offsets[1]);
+        img.blocks = reinterpret_cast<const Block*>(data + offsets[2]);
+        img.block_count = static_cast<size_t>(header.block_count);
+        img.output_cells = reinterpret_cast<const OutputCell*>(data + offsets[3]);
+        img.output_cell_count = static_cast<size_t>(header.output_cell_count);
+        img.output_strings = reinterpret_cast<const char*>(data + offsets[4]);
+        img.output_strings_size = static_cast<size_t>(header.output_strings_size);
+        img.code = reinterpret_cast<const char*>(data + offsets[5]);
+        img.code_size = static_cast<size_t>(header.code_size);
+        if (!verifyImage(img)) return false;
+        error.clear();
+        mapping.swap(file);
+        owned_source.clear();
+        ops.clear();
+        image = img;
+        command_count = img.code_size;
+        source_map.reset(img.code, img.code_size, false);
+        return true;
+    }
+
+    // Returns the index of the first unmatched bracket, or code_size if
+    // the brackets balance.
+    size_t findUnmatchedBracket() const {
+        std::vector<size_t> open;
+        for (size_t i = 0; i < image.code_size; i++) {
+            if (image.code[i] == '[') open.push_back(i);
+            if (image.code[i] == ']') {
+                if (open.empty()) return i;
+                open.pop_back();
+            }
+        }
+        return open.empty() ? image.code_size : open.front();
+    }
+
+    SourceLocation locate(size_t code_index) const { return source_map.locate(code_index); }
+};
+
+// Trace file layout: this header, the program's code, then one u64 record
+// per command run, holding the code offset in the low 32 bits, the pointer
+// in the next 24 and the cell before the command in the top 8. Native byte
+// order, like bytecode.
+struct TraceHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t endian;
+    uint32_t flags;
+    uint32_t record_size;
+    uint64_t code_size;
+};
+
+static const char TRACE_MAGIC[4] = {'T', 'R', 'B', 'T'};
+static const uint16_t TRACE_VERSION = 1;
+static const uint32_t TRACE_HAS_LINES = 1;
+
+// Saves trace records on a background thread. The machine and the thread
+// share a single-producer ring, so recording a command is a store and an
+// index bump; the machine only waits when the disk is a whole ring behind.
+class TraceWriter {
+private:
+    static constexpr size_t RING_SIZE = 1 << 20;
+    std::unique_ptr<uint64_t[]> ring;
+    std::atomic<size_t> head{0};  // next record the machine writes
+    std::atomic<size_t> tail{0};  // next record the thread saves
+    std::atomic<bool> closing{false};
+    size_t seen_tail = 0;
+    std::FILE* file = nullptr;
+    bool failed = false;
+    std::thread thread;
+
+    void drain() {
+        for (;;) {
+            size_t begin = tail.load(std::memory_order_relaxed);
+            size_t end = head.load(std::memory_order_acquire);
+            if (begin == end) {
+                if (closing.load(std::memory_order_acquire) && head.load(std::memory_order_acquire) == begin) return;
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                continue;
+            }
+            size_t first = begin & (RING_SIZE - 1);
+            size_t count = std::min(end - begin, RING_SIZE - first);
+            if (!failed && std::fwrite(ring.get() + first, sizeof(uint64_t), count, file) != count) failed = true;
+            tail.store(begin + count, std::memory_order_release);
+        }
+    }
+
+public:
+    ~TraceWriter() { close(); }
+
+    bool open(const std::string& path, const char* code, size_t code_size, bool lines) {
+        close();
+        file = std::fopen(path.c_str(), "wb");
+        if (!file) return false;
+        TraceHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, TRACE_MAGIC, 4);
+        header.version = TRACE_VERSION;
+        header.endian = BYTECODE_ENDIAN;
+        header.flags = lines ? TRACE_HAS_LINES : 0;
+        header.record_size = sizeof(uint64_t);
+        header.code_size = code_size;
+        failed = std::fwrite(&header, sizeof(header), 1, file) != 1 ||
+                 std::fwrite(code, 1, code_size, file) != code_size;
+        if (!ring) ring.reset(new uint64_t[RING_SIZE]);
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        closing.store(false, std::memory_order_relaxed);
+        seen_tail = 0;
+        thread = std::thread(&TraceWriter::drain, this);
+        return true;
+    }
+
+    void record(size_t code_pos, size_t pointer, unsigned char cell) {
+        size_t next = head.load(std::memory_order_relaxed);
+        while (next - seen_tail == RING_SIZE) {
+            seen_tail = tail.load(std::memory_order_acquire);
+            if (next - seen_tail == RING_SIZE) std::this_thread::yield();
+        }
+        ring[next & (RING_SIZE - 1)] = static_cast<uint64_t>(code_pos) | static_cast<uint64_t>(pointer) << 32 |
+                                       static_cast<uint64_t>(cell) << 56;
+        head.store(next + 1, std::memory_order_release);
+    }
+
+    // Waits for the thread to save everything. Returns false if any of it
+    // could not be written.
+    bool close() {
+        if (!file) return true;
+        closing.store(true, std::memory_order_release);
+        thread.join();
+        bool ok = std::fclose(file) == 0 && !failed;
+        file = nullptr;
+        return ok;
+    }
+};
+
+#ifndef _WIN32
+// Allocates whole pages, so a watchpoint can write-protect the part of the
+// tape holding its cell without touching anything else.
+template <typename T>
+struct PageAllocator {
+    using value_type = T;
+
+    PageAllocator() = default;
+    template <typename U>
+    PageAllocator(const PageAllocator<U>&) {}
+
+    static size_t pages(size_t n) {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return (n * sizeof(T) + page - 1) / page * page;
+    }
+    T* allocate(size_t n) {
+        void* p = mmap(nullptr, pages(n), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t n) { munmap(p, pages(n)); }
+
+    template <typename U>
+    bool operator==(const PageAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const PageAllocator<U>&) const { return false; }
+};
+using Tape = std::vector<unsigned char, PageAllocator<unsigned char>>;
+#else
+using Tape = std::vector<unsigned char>;
+#endif
+
+struct Machine::Impl {
+    Tape memory;
+    size_t memptr = 0;
+    std::vector<size_t> open;
+    std::string trace_path;
+    TraceWriter tracer;
+    bool tracing = false;
+    OutputSink sink;
+    InputSource source;
+    std::string error;
+    const Program::Impl* program = nullptr;
+
+    // Where a suspended run picks up: the next op, or the next character
+    // while a guard's fallback or the tracer is running, and how much of a
+    // multi-byte output op is already written. traced is the command the
+    // tracer suspended on, already recorded.
+    size_t pc = 0;
+    size_t code_pos = 0;
+    size_t code_end = 0;
+    size_t traced = SIZE_MAX;
+    bool in_code = false;
+    uint32_t partial = 0;
+    bool blocking = false;
+    bool finished = true;
+    RunStatus status = RunStatus::Done;
+
+    // Step budget. Every engine charges the same logical cost at loop
+    // back-edges, so the limits hold whichever one runs: steps counts the
+    // windows already used up, and fuel is what is left of the current
+    // one. Only running out of fuel takes the slow path that checks the
+    // step and time limits.
+    using Clock = std::chrono::steady_clock;
+    uint64_t max_steps = 0;
+    double time_limit = 0;
+    uint64_t steps = 0;
+    OpCounts counted;
+    uint64_t bytes_read = 0;
+    // The furthest cell the pointer has reached, and one past it. reach
+    // never passes the end of the tape, so moves compare against it alone
+    // and take the slow path only for a new furthest cell.
+    size_t tape_high = 0;
+    size_t reach = 1;
+    int64_t window = 0;
+    int64_t fuel = 0;
+    Clock::duration time_used{};
+    Clock::time_point deadline;
+    // Set from any thread by cancel() and read where fuel runs out, so
+    // cancelling costs the run nothing until then.
+    std::atomic<bool> cancelled{false};
+    static_assert(std::atomic<bool>::is_always_lock_free, "cancel() must be safe in a signal handler");
+    RunStatus stopped = RunStatus::FuelExhausted;
+
+    // Debugging. Only the first op of a group, the ops compiled from one
+    // source position, starts where running the source would have got to,
+    // so that is where traps go and where a stopped run can switch to
+    // running the source one command at a time. group_op maps each such
+    // position to its op. A trap runs the source from there, stopping
+    // exactly at any breakpoint in break_at, and goes back to the ops at
+    // the next group it reaches. trapped means the run stopped at a
+    // breakpoint and must not stop there again before moving on.
+    //
+    // While the ops run, the tape pages holding watched cells are
+    // write-protected; a write to one unprotects it and sets watch_fault.
+    // Both that and a watched cell that differs are looked at when the
+    // fuel window runs out. The state when the window opened is kept in
+    // epoch, so the window can then be rerun one command at a time to the
+    // command that changed a cell, even one changed back later, and the run
+    // carries on if the write was to another cell on the page. The source
+    // compares watched cells after every command instead. Output flushed
+    // since the epoch is held back in held, starting at stream position
+    // held_at, until the next epoch shows no cell changed.
+    struct Watch {
+        size_t cell;
+        unsigned char value;
+    };
+    struct Epoch {
+        bool valid = false;
+        uint64_t steps;
+        int64_t window;
+        int64_t fuel;
+        size_t pc;
+        size_t code_pos;
+        size_t code_end;
+        bool in_code;
+        bool in_source;
+        bool trapped;
+        std::vector<size_t> open;
+        size_t memptr;
+        size_t input;
+        uint64_t input_bytes;
+        size_t output;
+        std::vector<unsigned char> tape;
+    };
+    std::vector<size_t> breakpoints;
+    std::vector<Op> patched;
+    std::vector<bool> break_at;
+    std::vector<uint32_t> group_op;
+    const Program::Impl* grouped = nullptr;
+    std::vector<Watch> watches;
+    Epoch epoch;
+    volatile sig_atomic_t watch_fault = 0;
+    uintptr_t watched_begin = 0;
+    uintptr_t watched_end = 0;
+    bool armed = false;
+    std::string held;
+    size_t held_at = 0;
+    bool rewind = false;
+    bool trapped = false;
+    bool in_source = false;
+    bool stepped = false;
+
+    // Time travel. A checkpoint is taken at the first back-edge in the ops
+    // after every history_interval steps. It stores the range of the tape
+    // that changed since the one before, compared against shadow, and every
+    // KEYFRAME-th stores the whole tape. Input read is logged so a rerun
+    // reads the same bytes, and output the run has already written is not
+    // written again. stop_at ends the run at the first back-edge at or
+    // past that many steps.
+    struct Checkpoint {
+        uint64_t steps;
+        uint64_t commands;
+        size_t pc;
+        size_t memptr;
+        size_t input;
+        uint64_t input_bytes;
+        size_t output;
+        size_t changed;
+        std::vector<unsigned char> tape;
+    };
+    uint64_t history_interval = 0;
+    uint64_t next_checkpoint = 0;
+    uint64_t stop_at = UINT64_MAX;
+    std::vector<Checkpoint> checkpoints;
+    std::vector<unsigned char> shadow;
+    std::vector<int16_t> input_log;  // -1 for a read at end of input
+    size_t replayed = 0;
+    size_t written = 0;
+    size_t output_high = 0;
+
+    // Sampling profiler. While profiling, the ops publish the first op of
+    // the straight run between jumps they are in to current_op, and
+    // sample() counts a hit on it in samples, whose last entry holds hits
+    // outside the ops. Both are safe to touch from a signal handler on the
+    // running thread. Publishing at jumps rather than at every op keeps
+    // profiled runs within 2% of plain ones.
+    bool profiling = false;
+    std::atomic<const Op*> current_op{nullptr};
+    std::atomic<const Op*> current_ops{nullptr};
+    std::vector<uint32_t> samples;
+    static_assert(std::atomic<const Op*>::is_always_lock_free, "sample() must be safe in a signal handler");
+
+    // Coverage. While covering, covered holds Coverage flags per source
+    // position: a '[' gets SKIPPED or ENTERED, and a ']' gets RAN when its
+    // loop body completed and ITERATED when it jumped back. A collapsed
+    // loop marks all of them on its '['.
+    bool covering = false;
+    std::vector<uint8_t> covered;
+
+    // Tape heat map. While heat mapping, each access to a cell counts for
+    // its region of 1 << heat_shift cells, once per source command: '+',
+    // '-' and ',' write, while '.', '[' and ']' read. The ops count for
+    // the commands they were compiled from, so the counts do not depend on
+    // the optimization level.
+    bool heat_mapping = false;
+    unsigned heat_shift = 4;
+    std::vector<uint64_t> heat_reads;
+    std::vector<uint64_t> heat_writes;
+
+    // The accesses of the source a group of ops stands for, relative to
+    // the pointer where the group starts. The last op of each group counts
+    // heat_counts[begin, loop) once and, for a Set, [loop, end) once per
+    // iteration of the loop it replaced. [begin, head) are the commands
+    // before the group's own code, which a failed guard does not run.
+    struct HeatCount {
+        int64_t offset;
+        uint32_t reads;
+        uint32_t writes;
+    };
+    struct HeatSpan {
+        uint32_t begin, head, loop, end;
+    };
+    std::vector<HeatCount> heat_counts;
+    std::vector<HeatSpan> heat_spans;
+
+    void heatRead(size_t cell) { heat_reads[cell >> heat_shift]++; }
+    void heatWrite(size_t cell) { heat_writes[cell >> heat_shift]++; }
+
+    void heatCount(const HeatCount& count, uint64_t times) {
+        size_t distance = static_cast<size_t>(count.offset < 0 ? -count.offset : count.offset);
+        size_t cell = count.offset >= 0 ? memptr + distance : memptr > distance ? memptr - distance : 0;
+        if ((cell >> heat_shift) >= heat_reads.size()) return;
+        heat_reads[cell >> heat_shift] += count.reads * times;
+        heat_writes[cell >> heat_shift] += count.writes * times;
+    }
+
+    // Counts op i if it ends a group, with the loop a Set replaced run
+    // iterations times.
+    void heatOp(size_t i, uint64_t iterations) {
+        const HeatSpan& span = heat_spans[i];
+        for (uint32_t k = span.begin; k < span.loop; k++) heatCount(heat_counts[k], 1);
+        if (iterations == 0) return;
+        for (uint32_t k = span.loop; k < span.end; k++) heatCount(heat_counts[k], iterations);
+    }
+
+    // Adds the accesses of code[begin, end) to counts, at offsets from rel.
+    // Loops in the range never run, as the passes only drop dead ones,
+    // except a loop at collapsed, whose body goes to body instead.
+    void planAccesses(size_t begin, size_t end, size_t collapsed,
+                      std::map<int64_t, HeatCount>& counts, std::map<int64_t, HeatCount>& body) {
+        const char* code = program->image.code;
+        int64_t rel = 0;
+        for (size_t pos = begin; pos < end; pos++) {
+            switch (code[pos]) {
+                case '>': rel++; break;
+                case '<': rel--; break;
+                case '+': case '-': case ',': counts[rel].writes++; break;
+                case '.': case ']': counts[rel].reads++; break;
+                case '[':
+                {
+                    counts[rel].reads++;
+                    size_t close = pos;
+                    for (int depth = 1; depth > 0 && close + 1 < end;) {
+                        close++;
+                        if (code[close] == '[') depth++;
+                        if (code[close] == ']') depth--;
+                    }
+                    if (pos == collapsed) {
+                        std::map<int64_t, HeatCount> none;
+                        int64_t saved = rel;
+                        planAccesses(pos + 1, close + 1, SIZE_MAX, body, none);
+                        rel = saved;
+                    }
+                    pos = close;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Works out heat_spans for the program as start() sets it up.
+    void planHeat() {
+        const ProgramImage& image = program->image;
+        heat_counts.clear();
+        heat_spans.assign(image.op_count, HeatSpan{0, 0, 0, 0});
+        auto append = [&](const std::map<int64_t, HeatCount>& counts) {
+            for (const auto& count : counts) heat_counts.push_back({count.first, count.second.reads, count.second.writes});
+            return static_cast<uint32_t>(heat_counts.size());
+        };
+        size_t first = 0;
+        for (size_t i = 0; i < image.op_count; i++) {
+            if (i > 0 && image.op_code[i] != image.op_code[i - 1]) first = i;
+            if (i + 1 < image.op_count && image.op_code[i + 1] == image.op_code[i]) continue;
+            OpCode code = image.ops[i].code;
+            if (code == OpCode::End) continue;
+            bool jump = code == OpCode::JumpIfZero || code == OpCode::JumpIfNonZero;
+            size_t begin = first == 0 ? 0 : entry(first), own = image.op_code[first];
+            size_t end = jump ? image.op_code[i] + 1 : image.op_code[i + 1];
+            if (begin > own || own > end || end > image.code_size) continue;
+            size_t collapsed = code == OpCode::Set ? image.op_code[i] : SIZE_MAX;
+            std::map<int64_t, HeatCount> head, once, body;
+            planAccesses(begin, own, SIZE_MAX, head, body);
+            planAccesses(own, end, collapsed, once, body);
+            HeatSpan& span = heat_spans[i];
+            span.begin = static_cast<uint32_t>(heat_counts.size());
+            span.head = append(head);
+            span.loop = append(once);
+            span.end = append(body);
+        }
+    }
+
+    // The accesses of a source command other than ',', which only counts
+    // once it has read a byte.
+    void heatCommand(char c) {
+        if (c == '+' || c == '-') heatWrite(memptr);
+        else if (c == '.' || c == '[' || c == ']') heatRead(memptr);
+    }
+
+    static uint8_t loopEnd(unsigned char cell) {
+        return static_cast<uint8_t>(cell ? Coverage::RAN | Coverage::ITERATED : Coverage::RAN);
+    }
+
+    // A Set that replaced a loop runs it (cell * k) & 0xff times.
+    static uint8_t collapsedLoop(unsigned char cell, uint32_t cost) {
+        int iterations = (cell * (cost & 0xff)) & 0xff;
+        if (iterations == 0) return Coverage::SKIPPED;
+        return static_cast<uint8_t>(iterations == 1 ? Coverage::ENTERED | Coverage::RAN
+                                                    : Coverage::ENTERED | Coverage::RAN | Coverage::ITERATED);
+    }
+
+    static constexpr size_t MEMORY_LIMIT = 1000000;
+    static constexpr int64_t FUEL_WINDOW = 1 << 20;
+    static constexpr uint32_t NO_GROUP = UINT32_MAX;
+    static constexpr size_t KEYFRAME = 64;
+    static_assert(MEMORY_LIMIT <= 1 << 24, "trace records hold a 24-bit pointer");
+
+    Impl() : memory(30000, 0) {}
+
+    bool fail(const std::string& message) {
+        error = message;
+        return false;
+    }
+
+    // Output a rerun after travelling back has already written is dropped.
+    // While watches are set, output is held back until the next epoch, so
+    // none written after a watched cell changed gets out.
+    void flushOutput() {
+        if (sink.size == 0 || !sink.flush) return;
+        if (!watches.empty()) {
+            if (held.empty()) held_at = written;
+            held.append(sink.buffer, sink.size);
+        } else {
+            deliver(written, sink.buffer, sink.size);
+        }
+        written += sink.size;
+        sink.size = 0;
+    }
+
+    void releaseOutput() {
+        if (held.empty()) return;
+        deliver(held_at, held.data(), held.size());
+        held.clear();
+    }
+
+    void deliver(size_t at, const char* data, size_t size) {
+        size_t skip = at < output_high ? std::min(size, output_high - at) : 0;
+        if (skip < size) sink.flush(sink.user, data + skip, size - skip);
+        output_high = std::max(output_high, at + size);
+    }
+
+    // Makes room for at least one byte. When there is none, a resumable
+    // run suspends with OutputReady and a blocking run fails.
+    bool room() {
+        if (sink.size < sink.capacity) return true;
+        flushOutput();
+        return sink.size < sink.capacity;
+    }
+
+    RunStatus full() {
+        if (!blocking) return RunStatus::OutputReady;
+        fail("Output buffer full");
+        return RunStatus::Error;
+    }
+
+    // Writes data[partial, size), leaving partial at the first byte that
+    // did not fit.
+    bool writePartial(const char* data, uint32_t size) {
+        while (partial < size) {
+            if (!room()) return false;
+            size_t chunk = std::min(static_cast<size_t>(size - partial), sink.capacity - sink.size);
+            std::memcpy(sink.buffer + sink.size, data + partial, chunk);
+            sink.size += chunk;
+            partial += static_cast<uint32_t>(chunk);
+        }
+        partial = 0;
+        return true;
+    }
+
+    // Output is flushed first so prompts show before the program waits.
+    // Returns false when a resumable run has to wait for more input.
+    // With watches set, a watched cell that has changed is found first, so
+    // a prompt written after the change is not shown.
+    bool readInput(unsigned char& cell) {
+        if (!watches.empty() && watchMoved()) {
+            rewind = true;
+            return false;
+        }
+        flushOutput();
+        releaseOutput();
+        int input;
+        if (replayed < input_log.size()) {
+            input = input_log[replayed++];
+        } else {
+            input = readSource();
+            if (input == WAIT_INPUT) return false;
+            if (history_interval || !watches.empty()) {
+                input_log.push_back(static_cast<int16_t>(input));
+                replayed++;
+            }
+        }
+        cell = input < 0 ? 0 : static_cast<unsigned char>(input);
+        if (input >= 0) bytes_read++;
+        return true;
+    }
+
+    // The next input byte, -1 at end of input, or WAIT_INPUT when a
+    // resumable run has to wait for more.
+    static constexpr int WAIT_INPUT = -2;
+    int readSource() {
+        if (source.pos < source.size) return source.data[source.pos++];
+        if (source.read) {
+            int input = source.read(source.user);
+            return input < 0 ? -1 : input & 0xff;
+        }
+        if (!blocking && !source.closed) return WAIT_INPUT;
+        return -1;
+    }
+
+    void openWindow() {
+        uint64_t size = FUEL_WINDOW;
+        if (history_interval) size = std::min(size, history_interval);
+        if (max_steps) size = std::min(size, max_steps - steps);
+        if (stop_at != UINT64_MAX) size = std::min(size, stop_at - steps);
+        window = fuel = static_cast<int64_t>(size);
+    }
+
+    // Accounts the used-up window and opens the next one, or fails with
+    // stopped set when the run is cancelled or reaches a limit. The run can
+    // be resumed after raising the limit.
+    bool refuel() {
+        steps += static_cast<uint64_t>(window - fuel);
+        window = fuel = 0;
+        stopped = RunStatus::Cancelled;
+        if (cancelled.load(std::memory_order_relaxed)) return fail("Cancelled");
+        stopped = RunStatus::Stopped;
+        if (watchMoved()) {
+            rewind = true;
+            return false;
+        }
+        if (steps >= stop_at) return false;
+        stopped = RunStatus::FuelExhausted;
+        if (max_steps && steps > max_steps)
+            return fail("Step limit exceeded (" + std::to_string(max_steps) + " steps)");
+        if (time_limit > 0 && Clock::now() >= deadline) return fail("Time limit exceeded");
+        openWindow();
+        return true;
+    }
+
+    // refuel() for the ops, which also takes any checkpoint that is due;
+    // next is the op to carry on from, always the first of a group.
+    bool refuelAt(size_t next) {
+        pc = next;
+        if (!refuel()) return false;
+        if (history_interval && steps >= next_checkpoint) checkpoint();
+        if (!watches.empty()) takeEpoch();
+        return true;
+    }
+
+    // Cost of one iteration of the loop closed by code[close], for the
+    // character engines: its direct commands and the ']', with nested
+    // loops counting only their '['.
+    int64_t iterationCost(const char* code, size_t open_pos, size_t close) const {
+        int64_t cost = 1;
+        int depth = 0;
+        for (size_t i = open_pos + 1; i < close; i++) {
+            char c = code[i];
+            if (!SourceMap::isCommand(c)) continue;
+            if (depth == 0 && c != ']') cost++;
+            if (c == '[') depth++;
+            if (c == ']') depth--;
+        }
+        return cost;
+    }
+
+    bool growMemory(size_t code_index) {
+        if (memory.size() >= MEMORY_LIMIT)
+            return fail("Memory limit exceeded (1MB) at " + SourceMap::format(program->source_map.locate(code_index)));
+        memory.resize(std::min(memory.size() * 2, MEMORY_LIMIT), 0);
+        if (armed && !in_source) protect(true);
+        return true;
+    }
+
+    // Records the furthest cell a block reaches when it fits on the tape.
+    // Otherwise the block has to run from the source, which grows the tape.
+    bool extendBlock(const Block& block) {
+        size_t furthest = memptr + static_cast<size_t>(block.max_offset);
+        if (memptr < static_cast<size_t>(-block.min_offset) || furthest >= memory.size()) return false;
+        tape_high = furthest;
+        reach = furthest + 1;
+        return true;
+    }
+
+    // Records the pointer as the furthest cell yet, growing the tape if it
+    // has gone past the end.
+    bool extend(size_t code_index) {
+        while (memptr >= memory.size())
+            if (!growMemory(code_index)) return false;
+        tape_high = memptr;
+        reach = memptr + 1;
+        return true;
+    }
+
+    // Appends every watched cell that changed since it was last looked at
+    // to error.
+    bool watchesChanged() {
+        bool changed = false;
+        for (Watch& watch : watches) {
+            unsigned char value = watch.cell < memory.size() ? memory[watch.cell] : 0;
+            if (value == watch.value) continue;
+            if (!error.empty()) error += "; ";
+            error += "Watchpoint: cell " + std::to_string(watch.cell) + " changed from " +
+                     std::to_string(watch.value) + " to " + std::to_string(value);
+            watch.value = value;
+            changed = true;
+        }
+        return changed;
+    }
+
+    // Whether a watched cell may have changed since it was last looked at.
+    bool watchMoved() const {
+        if (watch_fault) return true;
+        for (const Watch& watch : watches)
+            if ((watch.cell < memory.size() ? memory[watch.cell] : 0) != watch.value) return true;
+        return false;
+    }
+
+#ifndef _WIN32
+    static std::atomic<Impl*> watching;
+    static struct sigaction previous_segv;
+    static struct sigaction previous_bus;
+
+    // A write to a watched page is retried once the page is writable. Any
+    // other fault goes back to the handler there was before, which then
+    // sees it when the write is retried.
+    static void onWriteFault(int signal, siginfo_t* info, void*) {
+        Impl* machine = watching.load();
+        uintptr_t address = reinterpret_cast<uintptr_t>(info->si_addr);
+        if (machine && address >= machine->watched_begin && address < machine->watched_end) {
+            uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+            mprotect(reinterpret_cast<void*>(address & ~(page - 1)), page, PROT_READ | PROT_WRITE);
+            machine->watch_fault = 1;
+            return;
+        }
+        sigaction(signal, signal == SIGSEGV ? &previous_segv : &previous_bus, nullptr);
+    }
+
+    void protect(bool on) {
+        uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        watched_begin = reinterpret_cast<uintptr_t>(memory.data());
+        watched_end = watched_begin + memory.size();
+        for (const Watch& watch : watches) {
+            if (watch.cell >= memory.size()) continue;
+            uintptr_t address = (watched_begin + watch.cell) & ~(page - 1);
+            mprotect(reinterpret_cast<void*>(address), page, on ? PROT_READ : PROT_READ | PROT_WRITE);
+        }
+    }
+
+    // Only one machine in the process can have its tape watched at a time.
+    // A traced run stays in the source, which needs no protection.
+    bool arm() {
+        watch_fault = 0;
+        if (watches.empty() || tracing) return true;
+        Impl* idle = nullptr;
+        if (!watching.compare_exchange_strong(idle, this)) return fail("Another machine is using watchpoints");
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_sigaction = onWriteFault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_segv);
+        sigaction(SIGBUS, &action, &previous_bus);
+        armed = true;
+        if (!in_source) protect(true);
+        return true;
+    }
+
+    void disarm() {
+        if (!armed) return;
+        protect(false);
+        sigaction(SIGSEGV, &previous_segv, nullptr);
+        sigaction(SIGBUS, &previous_bus, nullptr);
+        armed = false;
+        watching.store(nullptr);
+    }
+#else
+    // Without page protection only the compare at each refuel sees a
+    // change made by the ops.
+    void protect(bool) {}
+    bool arm() { return true; }
+    void disarm() {}
+#endif
+
+    // Called where a run can step through the source from, with no watched
+    // cell changed since the last epoch.
+    void takeEpoch() {
+        flushOutput();
+        releaseOutput();
+        epoch.valid = !tracing && buildGroups() && betweenCommands();
+        if (!epoch.valid) return;
+        if (history_interval == 0) {
+            input_log.erase(input_log.begin(), input_log.begin() + static_cast<ptrdiff_t>(replayed));
+            replayed = 0;
+        }
+        epoch.steps = steps;
+        epoch.window = window;
+        epoch.fuel = fuel;
+        epoch.pc = pc;
+        epoch.code_pos = code_pos;
+        epoch.code_end = code_end;
+        epoch.in_code = in_code;
+        epoch.in_source = in_source;
+        epoch.trapped = trapped;
+        epoch.open = open;
+        epoch.memptr = memptr;
+        epoch.input = replayed;
+        epoch.input_bytes = bytes_read;
+        epoch.output = written;
+        epoch.tape.assign(memory.begin(), memory.end());
+    }
+
+    // Reruns the epoch one command at a time up to the command that changed
+    // a watched cell, dropping the output held back since the epoch so the
+    // rerun writes it again, and returns true with result set to how the
+    // rerun ended. A write to a watched page may have left every watched
+    // cell alone: a run that was only interrupted to look is rerun as far
+    // as it got, and false returned for it to carry on from the source.
+    // Without an epoch the run stops where it noticed a change.
+    bool rewindToWrite(RunStatus& result) {
+        bool interrupted = rewind;
+        uint64_t noticed = steps + static_cast<uint64_t>(window - fuel);
+        rewind = false;
+        watch_fault = 0;
+        if (!epoch.valid) {
+            if (!watchMoved()) return !interrupted;
+            error.clear();
+            watchesChanged();
+            result = RunStatus::Stopped;
+            return true;
+        }
+        error.clear();
+        held.clear();
+        if (memory.size() < epoch.tape.size()) memory.resize(epoch.tape.size());
+        std::copy(epoch.tape.begin(), epoch.tape.end(), memory.begin());
+        std::fill(memory.begin() + static_cast<ptrdiff_t>(epoch.tape.size()), memory.end(), 0);
+        steps = epoch.steps;
+        window = epoch.window;
+        fuel = epoch.fuel;
+        pc = epoch.pc;
+        code_pos = epoch.code_pos;
+        code_end = epoch.code_end;
+        in_code = epoch.in_code;
+        in_source = epoch.in_source;
+        trapped = epoch.trapped;
+        open = epoch.open;
+        memptr = epoch.memptr;
+        replayed = epoch.input;
+        bytes_read = epoch.input_bytes;
+        written = epoch.output;
+        sink.size = 0;
+        partial = 0;
+        stepped = false;
+        epoch.valid = false;
+        toSource();
+        for (;;) {
+            result = runSource(1, false);
+            if (!stepped) return true;
+            stepped = false;
+            if (interrupted && steps + static_cast<uint64_t>(window - fuel) >= noticed &&
+                group_op[code_pos] != NO_GROUP)
+                return false;
+        }
+    }
+
+    // Groups inside a guarded block are left out, as their ops rely on the
+    // guard having checked the tape. Returns false if the ops are out of
+    // source order, which no pass does but a bytecode file could.
+    bool buildGroups() {
+        if (grouped == program) return !group_op.empty();
+        grouped = program;
+        const ProgramImage& image = program->image;
+        group_op.assign(image.code_size + 1, NO_GROUP);
+        size_t guarded_end = 0;
+        for (size_t i = 0; i < image.op_count; i++) {
+            if (i > 0 && image.op_code[i] < image.op_code[i - 1]) {
+                group_op.clear();
+                return false;
+            }
+            bool first = i == 0 || image.op_code[i] != image.op_code[i - 1];
+            if (first && i >= guarded_end) group_op[entry(i)] = static_cast<uint32_t>(i);
+            if (image.ops[i].code == OpCode::Guard) guarded_end = image.blocks[image.ops[i].arg].end;
+        }
+        return true;
+    }
+
+    // The command the source is at when op i runs. The op after a jump is
+    // reached from the bracket before it, so commands compiled away just
+    // after the bracket come before it rather than before the next group.
+    size_t entry(size_t i) const {
+        const ProgramImage& image = program->image;
+        if (i == 0 || (image.ops[i - 1].code != OpCode::JumpIfZero && image.ops[i - 1].code != OpCode::JumpIfNonZero))
+            return image.op_code[i];
+        size_t pos = image.op_code[i - 1] + 1;
+        while (pos < image.op_code[i] && !SourceMap::isCommand(image.code[pos])) pos++;
+        return pos;
+    }
+
+    // Copies the ops with a trap on the group holding each breakpoint.
+    void patch() {
+        patched.clear();
+        break_at.clear();
+        if (breakpoints.empty() || !program || program->image.op_count == 0 || !buildGroups()) return;
+        const ProgramImage& image = program->image;
+        patched.assign(image.ops, image.ops + image.op_count);
+        break_at.assign(image.code_size, false);
+        // A breakpoint off a command stops at the next one.
+        for (size_t offset : breakpoints) {
+            while (offset < image.code_size && !SourceMap::isCommand(image.code[offset])) offset++;
+            if (offset >= image.code_size) continue;
+            break_at[offset] = true;
+            for (size_t p = offset + 1; p-- > 0;) {
+                if (group_op[p] == NO_GROUP) continue;
+                patched[group_op[p]].code = OpCode::Trap;
+                break;
+            }
+        }
+    }
+
+    size_t location() const {
+        if (!program || program->image.op_count == 0) return 0;
+        return in_source || in_code ? code_pos : entry(pc);
+    }
+
+    // Moves a stopped run from the ops to the source, rebuilding the open
+    // loops from the brackets before the current command.
+    bool toSource() {
+        if (in_source) return true;
+        if (!buildGroups()) return fail("This program cannot be stepped");
+        if (!in_code) {
+            size_t position = entry(pc);
+            if (group_op[position] != pc) return fail("Cannot step from inside a folded command");
+            code_pos = position;
+        }
+        in_code = false;
+        open.clear();
+        const char* code = program->image.code;
+        for (size_t i = 0; i < code_pos; i++) {
+            if (code[i] == '[') open.push_back(i);
+            else if (code[i] == ']' && !open.empty()) open.pop_back();
+        }
+        traced = SIZE_MAX;
+        in_source = true;
+        return true;
+    }
+
+    // Commands before code[pos] whose steps are not counted yet. A loop's
+    // commands are counted when its ']' runs, so these are the ones outside
+    // every loop that has closed by pos.
+    uint64_t uncharged(size_t pos) const {
+        const char* code = program->image.code;
+        std::vector<uint64_t> outer;
+        uint64_t count = 0;
+        for (size_t i = 0; i < pos; i++) {
+            if (!SourceMap::isCommand(code[i])) continue;
+            count++;
+            if (code[i] == '[') {
+                outer.push_back(count);
+            } else if (code[i] == ']' && !outer.empty()) {
+                count = outer.back();
+                outer.pop_back();
+            }
+        }
+        return count;
+    }
+
+    uint64_t commands() const {
+        if (!program || program->image.op_count == 0) return 0;
+        return steps + static_cast<uint64_t>(window - fuel) + uncharged(location());
+    }
+
+    void checkpoint() {
+        Checkpoint saved;
+        saved.steps = steps + static_cast<uint64_t>(window - fuel);
+        saved.commands = saved.steps + uncharged(entry(pc));
+        saved.pc = pc;
+        saved.memptr = memptr;
+        saved.input = replayed;
+        saved.input_bytes = bytes_read;
+        saved.output = written + sink.size;
+        shadow.resize(memory.size(), 0);
+        size_t begin = 0, end = memory.size();
+        if (checkpoints.size() % KEYFRAME != 0) {
+            while (begin < end && memory[begin] == shadow[begin]) begin++;
+            while (end > begin && memory[end - 1] == shadow[end - 1]) end--;
+        }
+        saved.changed = begin;
+        saved.tape.assign(memory.begin() + static_cast<ptrdiff_t>(begin), memory.begin() + static_cast<ptrdiff_t>(end));
+        std::copy(saved.tape.begin(), saved.tape.end(), shadow.begin() + static_cast<ptrdiff_t>(begin));
+        checkpoints.push_back(std::move(saved));
+        next_checkpoint = checkpoints.back().steps + history_interval;
+    }
+
+    // Rebuilds the tape from the keyframe before the checkpoint and the
+    // changes after it.
+    void restore(size_t index) {
+        std::fill(memory.begin(), memory.end(), 0);
+        for (size_t i = index - index % KEYFRAME; i <= index; i++) {
+            const Checkpoint& saved = checkpoints[i];
+            if (memory.size() < saved.changed + saved.tape.size()) memory.resize(saved.changed + saved.tape.size(), 0);
+            std::copy(saved.tape.begin(), saved.tape.end(), memory.begin() + static_cast<ptrdiff_t>(saved.changed));
+        }
+        const Checkpoint& saved = checkpoints[index];
+        steps = saved.steps;
+        window = fuel = 0;
+        pc = saved.pc;
+        memptr = saved.memptr;
+        replayed = saved.input;
+        bytes_read = saved.input_bytes;
+        written = saved.output;
+        sink.size = 0;
+        partial = 0;
+        in_code = in_source = trapped = stepped = false;
+        open.clear();
+    }
+
+    // Whether commands() is exact: the run is between two commands rather
+    // than inside ops compiled from several, or lost after an error.
+    bool betweenCommands() const {
+        if (finished && status != RunStatus::Done) return false;
+        if (in_source || in_code) return true;
+        return group_op[entry(pc)] == pc;
+    }
+
+    // Moves the run to just before the given command, going back to the
+    // last checkpoint before it if it has already run and back is set. The
+    // ops run until close to it and the source the rest of the way.
+    RunStatus seek(uint64_t target, bool back) {
+        if (back && (!betweenCommands() || target < commands())) {
+            size_t index = checkpoints.size() - 1;
+            while (index > 0 && checkpoints[index].commands > target) index--;
+            restore(index);
+        }
+        // A back-edge can count at most 255 iterations of a loop of every
+        // command at once, so stopping this far short cannot overshoot.
+        uint64_t slack = 256 * (program->image.code_size + 1);
+        if (target > commands() + slack) {
+            stop_at = target - slack;
+            RunStatus result = runProgram();
+            stop_at = UINT64_MAX;
+            if (result != RunStatus::Stopped || !error.empty() || rewind) return result;
+        }
+        uint64_t now = commands();
+        if (now > target) {
+            fail("Cannot reach step " + std::to_string(target));
+            return RunStatus::Error;
+        }
+        if (!toSource()) return RunStatus::Error;
+        RunStatus result = runSource(target - now, false);
+        stepped = false;
+        return result;
+    }
+
+    // Breakpoints and watchpoints are left out, so a rerun does not stop at
+    // ones it has already passed.
+    RunStatus travel(uint64_t target) {
+        if (checkpoints.empty() || tracing) {
+            fail("No history to travel in");
+            return RunStatus::Stopped;
+        }
+        std::vector<Watch> watched;
+        std::vector<Op> traps;
+        std::vector<bool> breaks;
+        watched.swap(watches);
+        traps.swap(patched);
+        breaks.swap(break_at);
+        flushOutput();
+        finished = false;
+        trapped = false;
+        RunStatus result = enter([this, target] { return seek(target, true); });
+        watches.swap(watched);
+        patched.swap(traps);
+        break_at.swap(breaks);
+        for (Watch& watch : watches) watch.value = watch.cell < memory.size() ? memory[watch.cell] : 0;
+        return result;
+    }
+
+    // Runs code[code_pos, code_end) one character at a time. Guarded ranges
+    // never contain input and their brackets always balance.
+    RunStatus runCode() {
+        const char* code = program->image.code;
+        for (size_t i = code_pos; i < code_end; i++) {
+#ifdef TRBBFI_COUNT
+            if (SourceMap::isCommand(code[i])) counted.ops++;
+#endif
+            if (heat_mapping) heatCommand(code[i]);
+            switch (code[i]) {
+                case '>':
+                    memptr++;
+                    if (memptr >= reach && !extend(i)) return RunStatus::Error;
+                    break;
+                case '<':
+                    if (memptr > 0) memptr--;
+                    break;
+                case '+':
+                    memory[memptr]++;
+                    break;
+                case '-':
+                    memory[memptr]--;
+                    break;
+                case '.':
+                    if (!room()) {
+                        code_pos = i;
+                        return full();
+                    }
+                    sink.buffer[sink.size++] = static_cast<char>(memory[memptr]);
+                    break;
+                case '[':
+                    if (covering) covered[i] |= memory[memptr] ? Coverage::ENTERED : Coverage::SKIPPED;
+                    if (memory[memptr] != 0) {
+                        counted.loops++;
+                        open.push_back(i);
+                        break;
+                    }
+                    for (int depth = 1; depth > 0;) {
+                        i++;
+                        if (code[i] == '[') depth++;
+                        if (code[i] == ']') depth--;
+                    }
+                    break;
+                case ']':
+                    if (covering) covered[i] |= loopEnd(memory[memptr]);
+                    fuel -= iterationCost(code, open.back(), i);
+                    if (memory[memptr] != 0) i = open.back();
+                    else open.pop_back();
+                    if (fuel < 0 && !refuel()) {
+                        code_pos = i + 1;
+                        return stopped;
+                    }
+                    break;
+            }
+        }
+        in_code = false;
+        return RunStatus::Done;
+    }
+
+    // The run loop has instrumented copies for profiling alone, and for
+    // coverage and heat maps, so a plain run pays for none of them and a
+    // profiled one for no checks but its own.
+    enum class Instrument { None, Profile, All };
+
+    RunStatus executeCompiled() {
+        if (!profiling && !covering && !heat_mapping) return runOps<Instrument::None>();
+        current_ops.store(patched.empty() ? program->image.ops : patched.data(), std::memory_order_relaxed);
+        RunStatus result = covering || heat_mapping ? runOps<Instrument::All>() : runOps<Instrument::Profile>();
+        current_op.store(nullptr, std::memory_order_relaxed);
+        return result;
+    }
+
+    void sample() {
+        const Op* op = current_op.load(std::memory_order_relaxed);
+        const Op* ops = current_ops.load(std::memory_order_relaxed);
+        if (samples.empty()) return;
+        size_t index = op ? static_cast<size_t>(op - ops) : samples.size() - 1;
+        if (index < samples.size()) samples[index]++;
+    }
+
+    // Each sampled op is charged to its source line inside the loops that
+    // enclose it, so a straight run of ops spanning lines is charged to the
+    // line it starts on. A '[' belongs to the loop around it and a ']' to its own.
+    void writeProfile(std::ostream& os, const std::string& root) const {
+        if (!program || samples.empty()) return;
+        const ProgramImage& image = program->image;
+        std::map<std::string, uint64_t> stacks;
+        if (samples.back()) stacks[root + ";(outside the compiled program)"] += samples.back();
+        std::vector<size_t> enclosing;
+        size_t swept = 0;
+        for (size_t i = 0; i + 1 < samples.size(); i++) {
+            if (samples[i] == 0) continue;
+            size_t pos = image.op_code[i];
+            for (; swept < pos; swept++) {
+                if (image.code[swept] == '[') enclosing.push_back(swept);
+                else if (image.code[swept] == ']' && !enclosing.empty()) enclosing.pop_back();
+            }
+            std::string stack = root;
+            for (size_t loop : enclosing) stack += ";loop at " + SourceMap::format(program->locate(loop));
+            SourceLocation at = program->locate(pos);
+            stack += at.line ? ";line " + std::to_string(at.line) : ";command " + std::to_string(at.offset);
+            stacks[stack] += samples[i];
+        }
+        for (const auto& entry : stacks) os << entry.first << " " << entry.second << "\n";
+    }
+
+    // A command ran if its loop body completed once, or if the run stopped
+    // inside that body after it. A loop the compiler dropped as dead is
+    // skipped whenever its '[' ran.
+    void addCoverage(Coverage& coverage) const {
+        if (!program || covered.empty()) return;
+        const ProgramImage& image = program->image;
+        std::vector<size_t> match(image.code_size, SIZE_MAX);
+        std::vector<size_t> brackets;
+        for (size_t i = 0; i < image.code_size; i++) {
+            if (image.code[i] == '[') brackets.push_back(i);
+            else if (image.code[i] == ']' && !brackets.empty()) {
+                match[i] = brackets.back();
+                match[brackets.back()] = i;
+                brackets.pop_back();
+            }
+        }
+        size_t stop = finished && status == RunStatus::Done ? SIZE_MAX : location();
+        struct Body { bool all; bool partial; };
+        std::vector<Body> bodies = {{stop == SIZE_MAX, true}};
+        coverage.flags.resize(program->command_count);
+        size_t command = 0;
+        for (size_t i = 0; i < image.code_size && command < coverage.flags.size(); i++) {
+            char c = image.code[i];
+            if (!SourceMap::isCommand(c)) continue;
+            bool ran = bodies.back().all || (bodies.back().partial && i < stop);
+            uint8_t flags = ran ? Coverage::RAN : 0;
+            if (c == '[' && match[i] != SIZE_MAX) {
+                uint8_t loop = static_cast<uint8_t>(covered[i] | covered[match[i]]);
+                if (ran && !(loop & (Coverage::SKIPPED | Coverage::ENTERED))) loop |= Coverage::SKIPPED;
+                flags |= loop & (Coverage::SKIPPED | Coverage::ENTERED | Coverage::ITERATED);
+                bool entered = loop & Coverage::ENTERED;
+                bodies.push_back({entered && (loop & Coverage::RAN), entered && stop > i && stop <= match[i]});
+            } else if (c == ']' && match[i] != SIZE_MAX) {
+                flags = bodies.back().all ? Coverage::RAN : 0;
+                bodies.pop_back();
+            }
+            coverage.flags[command++] |= flags;
+        }
+        coverage.runs++;
+    }
+
+    template <Instrument Mode>
+    RunStatus runOps() {
+        const ProgramImage& image = program->image;
+        const bool profile = Mode == Instrument::Profile || (Mode == Instrument::All && profiling);
+        const bool cover = Mode == Instrument::All && covering, heat = Mode == Instrument::All && heat_mapping;
+        const Op* ops = patched.empty() ? image.ops : patched.data();
+        const Op* ip = ops + pc;
+        unsigned char* tape = memory.data();
+        // Kept in a local so tape stores, which may alias any member, do
+        // not force it back to memory on every loop iteration.
+        int64_t left = fuel;
+
+        if (profile) current_op.store(ip, std::memory_order_relaxed);
+        for (;;) {
+            const Op& op = *ip++;
+#ifdef TRBBFI_COUNT
+            counted.ops++;
+#endif
+            switch (op.code) {
+                case OpCode::Add:
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    tape[memptr + op.offset] = static_cast<unsigned char>(tape[memptr + op.offset] + op.arg);
+                    break;
+                case OpCode::Move:
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    if (op.arg < 0) {
+                        size_t distance = static_cast<size_t>(-op.arg);
+                        memptr = memptr > distance ? memptr - distance : 0;
+                    } else {
+                        memptr += static_cast<size_t>(op.arg);
+                        if (memptr >= reach) {
+                            if (!extend(image.op_code[ip - 1 - ops])) {
+                                fuel = left;
+                                return RunStatus::Error;
+                            }
+                            tape = memory.data();
+                        }
+                    }
+                    break;
+                case OpCode::Guard:
+                {
+                    const Block& block = image.blocks[op.arg];
+                    if ((memptr < static_cast<size_t>(-block.min_offset) ||
+                         memptr + static_cast<size_t>(block.max_offset) >= reach) && !extendBlock(block)) {
+                        if (heat) {
+                            const HeatSpan& span = heat_spans[block.end - 1];
+                            for (uint32_t k = span.begin; k < span.head; k++) heatCount(heat_counts[k], 1);
+                        }
+                        pc = block.end;
+                        code_pos = block.code_begin;
+                        code_end = block.code_end;
+                        in_code = true;
+                        open.clear();
+                        fuel = left;
+                        RunStatus result = runCode();
+                        if (result != RunStatus::Done) return result;
+                        left = fuel;
+                        tape = memory.data();
+                        ip = ops + block.end;
+                        if (profile) current_op.store(ip, std::memory_order_relaxed);
+                    } else if (heat) {
+                        heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    }
+                    break;
+                }
+                case OpCode::Output:
+                    if (!room()) {
+                        pc = static_cast<size_t>(ip - 1 - ops);
+                        fuel = left;
+                        return full();
+                    }
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    sink.buffer[sink.size++] = static_cast<char>(tape[memptr + op.offset] + op.arg);
+                    break;
+                case OpCode::OutputConst:
+                    if (!writePartial(image.output_strings + op.arg, op.len)) {
+                        pc = static_cast<size_t>(ip - 1 - ops);
+                        fuel = left;
+                        return full();
+                    }
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    break;
+                case OpCode::OutputCells:
+                {
+                    const OutputCell* cells = image.output_cells + op.arg;
+                    for (; partial < op.len; partial++) {
+                        if (!room()) {
+                            pc = static_cast<size_t>(ip - 1 - ops);
+                            fuel = left;
+                            return full();
+                        }
+                        const OutputCell& cell = cells[partial];
+                        unsigned char value = cell.constant ? cell.value
+                            : static_cast<unsigned char>(tape[memptr + cell.offset] + cell.value);
+                        sink.buffer[sink.size++] = static_cast<char>(value);
+                    }
+                    partial = 0;
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    break;
+                }
+                case OpCode::Input:
+                    if (!readInput(tape[memptr])) {
+                        pc = static_cast<size_t>(ip - 1 - ops);
+                        fuel = left;
+                        return RunStatus::NeedInput;
+                    }
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    break;
+                case OpCode::JumpIfZero:
+                    if (cover) covered[image.op_code[ip - 1 - ops]] |= tape[memptr] ? Coverage::ENTERED : Coverage::SKIPPED;
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    if (tape[memptr] == 0) ip = ops + op.arg;
+                    else counted.loops++;
+                    if (profile) current_op.store(ip, std::memory_order_relaxed);
+                    break;
+                case OpCode::JumpIfNonZero:
+                    if (cover) covered[image.op_code[ip - 1 - ops]] |= loopEnd(tape[memptr]);
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    if (tape[memptr] != 0) ip = ops + op.arg;
+                    if (profile) current_op.store(ip, std::memory_order_relaxed);
+                    if ((left -= op.len) < 0) {
+                        fuel = left;
+                        if (!refuelAt(static_cast<size_t>(ip - ops))) return stopped;
+                        left = fuel;
+                    }
+                    break;
+                case OpCode::Set:
+                    if (cover) covered[image.op_code[ip - 1 - ops]] |= collapsedLoop(tape[memptr + op.offset], op.len);
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), (tape[memptr + op.offset] * (op.len & 0xff)) & 0xff);
+                    left -= static_cast<int64_t>((tape[memptr + op.offset] * (op.len & 0xff)) & 0xff) * (op.len >> 8);
+                    tape[memptr + op.offset] = static_cast<unsigned char>(op.arg);
+                    if (left < 0) {
+                        fuel = left;
+                        if (!refuelAt(static_cast<size_t>(ip - ops))) return stopped;
+                        left = fuel;
+                    }
+                    break;
+                case OpCode::Mul:
+                    if (heat) heatOp(static_cast<size_t>(ip - 1 - ops), 0);
+                    tape[memptr + op.offset] = static_cast<unsigned char>(tape[memptr + op.offset] + tape[memptr] * op.arg);
+                    break;
+                case OpCode::End:
+                    pc = static_cast<size_t>(ip - 1 - ops);
+                    fuel = left;
+                    // Dead code after the last loop still runs its skips, so
+                    // the run ends at the end of the source.
+                    if (entry(pc) != program->image.op_code[pc] && buildGroups() && toSource()) return runSource(UINT64_MAX, false);
+                    return RunStatus::Done;
+                case OpCode::Trap:
+                {
+                    pc = static_cast<size_t>(ip - 1 - ops);
+                    fuel = left;
+                    toSource();
+                    RunStatus result = runSource(UINT64_MAX, true);
+                    if (result != RunStatus::Done || in_source) return result;
+                    left = fuel;
+                    tape = memory.data();
+                    ip = ops + pc;
+                    if (profile) current_op.store(ip, std::memory_order_relaxed);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Runs the source one command at a time from code_pos, recording each
+    // to the trace when tracing. Stops with stepped set once count commands
+    // have run, right after a command that changed a watched cell, and
+    // with to_ops hands over to the ops at the first group it reaches after
+    // running a command.
+    RunStatus runSource(uint64_t count, bool to_ops) {
+        const ProgramImage& image = program->image;
+        bool moved = false;
+        if (armed) protect(false);
+        for (; code_pos < image.code_size; code_pos++) {
+            char c = image.code[code_pos];
+            if (!SourceMap::isCommand(c)) continue;
+            if (to_ops && moved && group_op[code_pos] != NO_GROUP) {
+                pc = group_op[code_pos];
+                in_source = false;
+                if (armed) protect(true);
+                return RunStatus::Done;
+            }
+            if (!break_at.empty() && break_at[code_pos] && !trapped) {
+                trapped = true;
+                in_source = true;
+                fail("Breakpoint at " + SourceMap::format(program->locate(code_pos)));
+                return RunStatus::Stopped;
+            }
+            if (count == 0) {
+                stepped = true;
+                return RunStatus::Stopped;
+            }
+            moved = true;
+            trapped = false;
+            if (traced == code_pos) traced = SIZE_MAX;
+            else if (tracing) tracer.record(code_pos, memptr, memory[memptr]);
+            if (heat_mapping) heatCommand(c);
+
+            switch (c) {
+                case '>':
+                    memptr++;
+                    if (memptr >= reach && !extend(code_pos)) return RunStatus::Error;
+                    break;
+                case '<':
+                    if (memptr > 0) memptr--;
+                    break;
+                case '+':
+                    memory[memptr]++;
+                    break;
+                case '-':
+                    memory[memptr]--;
+                    break;
+                case '.':
+                    if (!room()) {
+                        traced = code_pos;
+                        return full();
+                    }
+                    sink.buffer[sink.size++] = static_cast<char>(memory[memptr]);
+                    break;
+                case ',':
+                    if (!readInput(memory[memptr])) {
+                        traced = code_pos;
+                        return RunStatus::NeedInput;
+                    }
+                    if (heat_mapping) heatWrite(memptr);
+                    break;
+                case '[':
+                    if (covering) covered[code_pos] |= memory[memptr] ? Coverage::ENTERED : Coverage::SKIPPED;
+                    if (memory[memptr] == 0) {
+                        int balance = 1;
+                        size_t pos = code_pos + 1;
+                        while (pos < image.code_size && balance > 0) {
+                            if (image.code[pos] == '[') balance++;
+                            if (image.code[pos] == ']') balance--;
+                            pos++;
+                        }
+                        if (balance > 0) {
+                            fail("Unmatched '[' at " + SourceMap::format(program->locate(code_pos)));
+                            return RunStatus::Error;
+                        }
+                        code_pos = pos - 1;
+                    } else {
+                        counted.loops++;
+                        open.push_back(code_pos);
+                    }
+                    break;
+                case ']':
+                    if (open.empty()) {
+                        fail("Unmatched ']' at " + SourceMap::format(program->locate(code_pos)));
+                        return RunStatus::Error;
+                    }
+                    if (covering) covered[code_pos] |= loopEnd(memory[memptr]);
+                    fuel -= iterationCost(image.code, open.back(), code_pos);
+                    if (memory[memptr] != 0) code_pos = open.back();
+                    else open.pop_back();
+                    if (fuel < 0 && !refuel()) {
+                        code_pos++;
+                        count--;
+                        return stopped;
+                    }
+                    break;
+            }
+            if (!watches.empty() && watchesChanged()) {
+                code_pos++;
+                return RunStatus::Stopped;
+            }
+            count--;
+        }
+        return RunStatus::Done;
+    }
+
+    RunStatus runProgram() {
+        if (tracing) return runSource(UINT64_MAX, false);
+        RunStatus result = RunStatus::Done;
+        if (in_source) {
+            result = runSource(UINT64_MAX, true);
+            if (in_source) return result;
+        }
+        if (result == RunStatus::Done && in_code) result = runCode();
+        if (result == RunStatus::Done) result = executeCompiled();
+        return result;
+    }
+
+    // A run carrying on after a write to a watched page comes back here
+    // with the target already set.
+    RunStatus step(uint64_t count) {
+        bool aimed = false;
+        uint64_t target = 0;
+        return enter([this, count, &aimed, &target] {
+            if (!aimed) {
+                if (!buildGroups() || !betweenCommands()) {
+                    fail("Cannot step from inside a folded command");
+                    return RunStatus::Stopped;
+                }
+                uint64_t now = commands();
+                target = count > UINT64_MAX - now ? UINT64_MAX : now + count;
+                aimed = true;
+            }
+            return seek(target, false);
+        });
+    }
+
+    void start(const Program::Impl& compiled) {
+        error.clear();
+        program = &compiled;
+        std::fill(memory.begin(), memory.end(), 0);
+        memptr = 0;
+        pc = 0;
+        partial = 0;
+        code_pos = 0;
+        code_end = 0;
+        traced = SIZE_MAX;
+        in_code = false;
+        in_source = false;
+        trapped = false;
+        stepped = false;
+        open.clear();
+        for (Watch& watch : watches) watch.value = 0;
+        epoch.valid = false;
+        rewind = false;
+        grouped = nullptr;
+        checkpoints.clear();
+        shadow.assign(memory.size(), 0);
+        input_log.clear();
+        replayed = 0;
+        written = 0;
+        output_high = 0;
+        stop_at = UINT64_MAX;
+        finished = false;
+        steps = 0;
+        counted = OpCounts();
+        samples.assign(profiling ? compiled.image.op_count + 1 : 0, 0);
+        covered.assign(covering ? compiled.image.code_size : 0, 0);
+        heat_reads.assign(heat_mapping ? (MEMORY_LIMIT >> heat_shift) + 1 : 0, 0);
+        heat_writes.assign(heat_reads.size(), 0);
+        if (heat_mapping) planHeat();
+        current_op.store(nullptr, std::memory_order_relaxed);
+        bytes_read = 0;
+        tape_high = 0;
+        reach = 1;
+        time_used = Clock::duration();
+        cancelled.store(false, std::memory_order_relaxed);
+        openWindow();
+        tracer.close();
+        tracing = false;
+        patch();
+        if (compiled.image.op_count == 0) {
+            fail(compiled.error.empty() ? "No program loaded" : compiled.error);
+            finished = true;
+            status = RunStatus::Error;
+        } else if (!trace_path.empty() &&
+                   !tracer.open(trace_path, compiled.image.code, compiled.image.code_size,
+                                compiled.source_map.hasLines())) {
+            fail("Cannot create trace file " + trace_path);
+            finished = true;
+            status = RunStatus::Error;
+        } else {
+            tracing = !trace_path.empty();
+            if (history_interval && !tracing && buildGroups()) checkpoint();
+        }
+    }
+
+    RunStatus resume() {
+        return enter([this] { return runProgram(); });
+    }
+
+    // Time is only counted while the machine runs, so a session waiting
+    // for input does not use up its time limit.
+    template <typename Run>
+    RunStatus enter(Run&& run) {
+        if (finished) return status;
+        Clock::time_point entered;
+        if (time_limit > 0) {
+            entered = Clock::now();
+            deadline = entered + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(time_limit)) -
+                       time_used;
+        }
+        error.clear();
+        RunStatus result = RunStatus::Stopped;
+        if (!arm()) {
+            // Nothing ran, so the run can still go on once the watch is free.
+        } else {
+            if (!watches.empty()) takeEpoch();
+            if ((window == 0 || cancelled.load(std::memory_order_relaxed)) && !refuel()) {
+                result = stopped;
+            } else {
+                result = run();
+            }
+            while (rewind || ((result == RunStatus::Done || result == RunStatus::Stopped ||
+                               result == RunStatus::NeedInput || result == RunStatus::FuelExhausted) &&
+                              watchMoved())) {
+                disarm();
+                if (rewindToWrite(result)) break;
+                if (!arm()) {
+                    result = RunStatus::Stopped;
+                    break;
+                }
+                takeEpoch();
+                result = run();
+            }
+            disarm();
+        }
+        if (time_limit > 0) time_used += Clock::now() - entered;
+        if (result != RunStatus::NeedInput && result != RunStatus::OutputReady) flushOutput();
+        releaseOutput();
+        if (result == RunStatus::Done || result == RunStatus::Error || result == RunStatus::Cancelled) {
+            finished = true;
+            if (!tracer.close() && result != RunStatus::Error) {
+                fail("Cannot write trace file " + trace_path);
+                result = RunStatus::Error;
+            }
+        }
+        status = result;
+        return result;
+    }
+};
+
+// One tape cell across all lanes, so each op below works on every lane at
+// once. Lanes that have left a loop the others are still running are
+// masked off: active has one bit per running lane and blend is the same
+// mask a byte per lane.
+typedef uint8_t LaneCell __attribute__((vector_size(LaneMachine::LANES)));
+static_assert(LaneMachine::LANES <= 32, "lane masks are 32 bits");
+
+struct LaneMachine::Impl {
+    std::vector<LaneCell> memory;
+    size_t memptr = 0;
+    uint32_t active = 0;
+    LaneCell blend = {};
+    std::string outputs[LANES];
+
+    // A loop some lanes left early. They rejoin once the rest leave it,
+    // which is only right if the pointer is back where they left it.
+    struct Divergence {
+        size_t loop_end;
+        size_t memptr;
+        uint32_t active;
+    };
+    std::vector<Divergence> diverged;
+
+    static constexpr size_t MEMORY_LIMIT = 1000000;
+    static constexpr size_t OUTPUT_LIMIT = 1 << 20;
+
+    // Step budget, charged at the same back-edges as Machine charges.
+    // steps counts the windows used up and fuel is what is left of the
+    // current one; the limits and cancel() are checked when it runs out.
+    using Clock = std::chrono::steady_clock;
+    static constexpr int64_t FUEL_WINDOW = 1 << 20;
+    uint64_t max_steps = 0;
+    double time_limit = 0;
+    uint64_t steps = 0;
+    int64_t window = 0;
+    int64_t fuel = 0;
+    Clock::time_point deadline;
+    std::atomic<bool> cancelled{false};
+    std::string error;
+
+    void openWindow() {
+        uint64_t size = FUEL_WINDOW;
+        if (max_steps) size = std::min(size, max_steps - steps);
+        window = fuel = static_cast<int64_t>(size);
+    }
+
+    bool refuel() {
+        steps += static_cast<uint64_t>(window - fuel);
+        if (cancelled.load(std::memory_order_relaxed)) {
+            error = "Cancelled";
+            return false;
+        }
+        if (max_steps && steps > max_steps) return false;
+        if (time_limit > 0 && Clock::now() >= deadline) return false;
+        openWindow();
+        return true;
+    }
+
+    static LaneCell splat(uint8_t value) {
+        LaneCell cell;
+        for (size_t lane = 0; lane < LANES; lane++) cell[lane] = value;
+        return cell;
+    }
+
+    static uint32_t nonZero(LaneCell cell) {
+#if defined(__SSE2__)
+        static_assert(LANES == 16, "movemask covers 16 lanes");
+        __m128i bytes;
+        std::memcpy(&bytes, &cell, sizeof(bytes));
+        return ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128()))) & 0xffff;
+#else
+        uint32_t bits = 0;
+        for (size_t lane = 0; lane < LANES; lane++)
+            if (cell[lane]) bits |= 1u << lane;
+        return bits;
+#endif
+    }
+
+    void setActive(uint32_t lanes) {
+        active = lanes;
+        for (size_t lane = 0; lane < LANES; lane++) blend[lane] = (lanes >> lane) & 1 ? 0xff : 0;
+    }
+
+    bool reserve(size_t cells) {
+        if (cells <= memory.size()) return true;
+        if (cells > MEMORY_LIMIT) return false;
+        memory.resize(std::min(MEMORY_LIMIT, std::max(cells, memory.size() * 2)), LaneCell{});
+        return true;
+    }
+
+    template <typename Emit>
+    void forActive(Emit&& emit) {
+        for (uint32_t lanes = active; lanes; lanes &= lanes - 1) emit(static_cast<size_t>(__builtin_ctz(lanes)));
+    }
+
+    // Output is held until the run ends, so a program that writes a lot
+    // is left to the scalar engine, which streams it.
+    bool outputFits() {
+        bool fits = true;
+        forActive([&](size_t lane) { fits &= outputs[lane].size() <= OUTPUT_LIMIT; });
+        return fits;
+    }
+
+    // Returns false where the lanes cannot stay in step; the caller then
+    // runs them one at a time.
+    bool run(const ProgramImage& image, const InputSource* inputs, size_t count) {
+        for (size_t lane = 0; lane < count; lane++)
+            if (inputs[lane].read) return false;
+        std::fill(memory.begin(), memory.end(), LaneCell{});
+        if (!reserve(1024)) return false;
+        memptr = 0;
+        diverged.clear();
+        steps = 0;
+        openWindow();
+        if (time_limit > 0)
+            deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(time_limit));
+        setActive(count >= 32 ? ~0u : (1u << count) - 1);
+        size_t input_pos[LANES];
+        for (size_t lane = 0; lane < LANES; lane++) {
+            outputs[lane].clear();
+            input_pos[lane] = lane < count ? inputs[lane].pos : 0;
+        }
+
+        const Op* ops = image.ops;
+        for (size_t ip = 0;;) {
+            const Op& op = ops[ip++];
+            switch (op.code) {
+                case OpCode::Add:
+                    memory[memptr + op.offset] += splat(static_cast<uint8_t>(op.arg)) & blend;
+                    break;
+                case OpCode::Move:
+                    if (op.arg < 0) {
+                        size_t distance = static_cast<size_t>(-op.arg);
+                        memptr = memptr > distance ? memptr - distance : 0;
+                    } else {
+                        memptr += static_cast<size_t>(op.arg);
+                        if (!reserve(memptr + 1)) return false;
+                    }
+                    break;
+                case OpCode::Guard:
+                {
+                    // Below cell 0 the block would rerun from source with
+                    // clamping, which this engine does not follow.
+                    const Block& block = image.blocks[op.arg];
+                    if (memptr < static_cast<size_t>(-block.min_offset)) return false;
+                    if (!reserve(memptr + static_cast<size_t>(block.max_offset) + 1)) return false;
+                    break;
+                }
+                case OpCode::Output:
+                {
+                    const LaneCell& cell = memory[memptr + op.offset];
+                    forActive([&](size_t lane) { outputs[lane].push_back(static_cast<char>(cell[lane] + op.arg)); });
+                    if (!outputFits()) return false;
+                    break;
+                }
+                case OpCode::OutputConst:
+                    forActive([&](size_t lane) { outputs[lane].append(image.output_strings + op.arg, op.len); });
+                    if (!outputFits()) return false;
+                    break;
+                case OpCode::OutputCells:
+                {
+                    const OutputCell* cells = image.output_cells + op.arg;
+                    forActive([&](size_t lane) {
+                        for (uint32_t k = 0; k < op.len; k++) {
+                            const OutputCell& cell = cells[k];
+                            unsigned char value = cell.constant ? cell.value
+                                : static_cast<unsigned char>(memory[memptr + cell.offset][lane] + cell.value);
+                            outputs[lane].push_back(static_cast<char>(value));
+                        }
+                    });
+                    if (!outputFits()) return false;
+                    break;
+                }
+                case OpCode::Input:
+                {
+                    LaneCell& cell = memory[memptr];
+                    forActive([&](size_t lane) {
+                        const InputSource& input = inputs[lane];
+                        cell[lane] = input_pos[lane] < input.size ? input.data[input_pos[lane]++] : 0;
+                    });
+                    break;
+                }
+                case OpCode::JumpIfZero:
+                {
+                    uint32_t entering = nonZero(memory[memptr]) & active;
+                    if (entering == 0) {
+                        ip = static_cast<size_t>(op.arg);
+                    } else if (entering != active) {
+                        diverged.push_back({static_cast<size_t>(op.arg) - 1, memptr, active});
+                        setActive(entering);
+                    }
+                    break;
+                }
+                case OpCode::JumpIfNonZero:
+                {
+                    if ((fuel -= op.len) < 0 && !refuel()) return false;
+                    uint32_t staying = nonZero(memory[memptr]) & active;
+                    bool masked = !diverged.empty() && diverged.back().loop_end == ip - 1;
+                    if (masked && diverged.back().memptr != memptr) return false;
+                    if (staying == 0) {
+                        if (masked) {
+                            setActive(diverged.back().active);
+                            diverged.pop_back();
+                        }
+                        break;
+                    }
+                    if (staying != active) {
+                        if (!masked) diverged.push_back({ip - 1, memptr, active});
+                        setActive(staying);
+                    }
+                    ip = static_cast<size_t>(op.arg);
+                    break;
+                }
+                case OpCode::Set:
+                {
+                    LaneCell& cell = memory[memptr + op.offset];
+                    int64_t cost = 0;
+                    forActive([&](size_t lane) {
+                        cost = std::max<int64_t>(cost, (cell[lane] * (op.len & 0xff)) & 0xff);
+                    });
+                    cell = (cell & ~blend) | (splat(static_cast<uint8_t>(op.arg)) & blend);
+                    if ((fuel -= cost * (op.len >> 8)) < 0 && !refuel()) return false;
+                    break;
+                }
+                case OpCode::Mul:
+                    memory[memptr + op.offset] += (memory[memptr] * splat(static_cast<uint8_t>(op.arg))) & blend;
+                    break;
+                case OpCode::End:
+                    return true;
+                case OpCode::Trap:
+                    return false;
+            }
+        }
+    }
+};
+
+Program::Program() : impl(new Impl) {}
+Program::~Program() = default;
+
+void Program::setCompileOptions(const CompileOptions& options) { impl->compile_options = options; }
+
+bool Program::isPass(const std::string& name) {
+    for (const auto& pass : Impl::passRegistry())
+        if (name == pass.name) return true;
+    return false;
+}
+
+bool Program::compile(const std::string& source) {
+    impl->mapping.close();
+    impl->owned_source = source;
+    return impl->compileSource(impl->owned_source.data(), impl->owned_source.size());
+}
+
+bool Program::compile(const char* source, size_t size) {
+    impl->mapping.close();
+    impl->owned_source.clear();
+    return impl->compileSource(source, size);
+}
+
+bool Program::load(const std::string& path) { return impl->load(path); }
+bool Program::saveBytecode(const std::string& path) const { return impl->saveBytecode(path); }
+bool Program::valid() const { return impl->image.op_count > 0; }
+const std::string& Program::error() const { return impl->error; }
+const char* Program::code() const { return impl->image.code; }
+size_t Program::codeSize() const { return impl->image.code_size; }
+size_t Program::commandCount() const { return impl->command_count; }
+size_t Program::findUnmatchedBracket() const { return impl->findUnmatchedBracket(); }
+SourceLocation Program::locate(size_t code_index) const { return impl->locate(code_index); }
+std::string Program::formatLocation(const SourceLocation& loc) { return SourceMap::format(loc); }
+void Program::dumpIR(std::ostream& os) const { impl->dumpIR(os); }
+
+#ifndef _WIN32
+std::atomic<Machine::Impl*> Machine::Impl::watching{nullptr};
+struct sigaction Machine::Impl::previous_segv;
+struct sigaction Machine::Impl::previous_bus;
+#endif
+
+Machine::Machine() : impl(new Impl) {}
+Machine::~Machine() = default;
+
+OutputSink& Machine::output() { return impl->sink; }
+InputSource& Machine::input() { return impl->source; }
+void Machine::setTrace(const std::string& path) { impl->trace_path = path; }
+
+void Machine::addBreakpoint(size_t code_index) {
+    impl->breakpoints.push_back(code_index);
+    if (!impl->finished) impl->patch();
+}
+
+bool Machine::addWatchpoint(size_t cell) {
+    if (cell >= Impl::MEMORY_LIMIT) {
+        impl->error = "Cell " + std::to_string(cell) + " is past the memory limit";
+        return false;
+    }
+    impl->watches.push_back({cell, static_cast<unsigned char>(cell < impl->memory.size() ? impl->memory[cell] : 0)});
+    impl->epoch.valid = false;
+    return true;
+}
+
+void Machine::clearBreakpoints() {
+    impl->breakpoints.clear();
+    impl->patched.clear();
+    impl->break_at.clear();
+}
+
+void Machine::clearWatchpoints() { impl->watches.clear(); }
+RunStatus Machine::step(uint64_t count) { return impl->step(count); }
+void Machine::setHistory(uint64_t interval) { impl->history_interval = interval; }
+RunStatus Machine::travel(uint64_t command) { return impl->travel(command); }
+uint64_t Machine::commands() const { return impl->commands(); }
+size_t Machine::location() const { return impl->location(); }
+void Machine::start(const Program& program) { impl->start(*program.impl); }
+RunStatus Machine::resume() { return impl->resume(); }
+
+bool Machine::run(const Program& program) {
+    impl->blocking = true;
+    impl->start(*program.impl);
+    RunStatus result = impl->resume();
+    impl->blocking = false;
+    return result == RunStatus::Done;
+}
+
+void Machine::setMaxSteps(uint64_t steps) {
+    impl->steps += static_cast<uint64_t>(impl->window - impl->fuel);
+    impl->window = impl->fuel = 0;
+    impl->max_steps = steps;
+}
+
+void Machine::cancel() { impl->cancelled.store(true, std::memory_order_relaxed); }
+
+void Machine::setProfiling(bool on) { impl->profiling = on; }
+void Machine::sample() { impl->sample(); }
+void Machine::writeProfile(std::ostream& os, const std::string& root) const { impl->writeProfile(os, root); }
+void Machine::setCoverage(bool on) { impl->covering = on; }
+
+void Machine::setTapeHeatmap(size_t region) {
+    impl->heat_mapping = region != 0;
+    impl->heat_shift = 0;
+    while ((size_t(1) << impl->heat_shift) < region && impl->heat_shift < 20) impl->heat_shift++;
+}
+
+TapeHeat Machine::tapeHeat() const {
+    TapeHeat heat;
+    heat.region = size_t(1) << impl->heat_shift;
+    size_t used = impl->heat_reads.size();
+    while (used && !impl->heat_reads[used - 1] && !impl->heat_writes[used - 1]) used--;
+    heat.reads.assign(impl->heat_reads.begin(), impl->heat_reads.begin() + static_cast<std::ptrdiff_t>(used));
+    heat.writes.assign(impl->heat_writes.begin(), impl->heat_writes.begin() + static_cast<std::ptrdiff_t>(used));
+    return heat;
+}
+void Machine::addCoverage(Coverage& coverage) const { impl->addCoverage(coverage); }
+
+void Machine::setTimeLimit(double seconds) { impl->time_limit = seconds; }
+uint64_t Machine::steps() const { return impl->steps + static_cast<uint64_t>(impl->window - impl->fuel); }
+OpCounts Machine::counts() const { return impl->counted; }
+
+RunStats Machine::stats() const {
+    RunStats stats;
+    stats.steps = commands();
+    stats.input_bytes = impl->bytes_read;
+    stats.output_bytes = impl->written + impl->sink.size;
+    stats.tape_cells = impl->program ? impl->tape_high + 1 : 0;
+#ifdef TRBBFI_COUNT
+    stats.counted = true;
+#endif
+    stats.counts = impl->counted;
+    return stats;
+}
+const std::string& Machine::error() const { return impl->error; }
+const unsigned char* Machine::tape() const { return impl->memory.data(); }
+size_t Machine::tapeSize() const { return impl->memory.size(); }
+size_t Machine::pointer() const { return impl->memptr; }
+
+void Machine::reset() {
+    std::fill(impl->memory.begin(), impl->memory.end(), 0);
+    impl->memptr = 0;
+    impl->tracer.close();
+    impl->finished = true;
+    impl->status = RunStatus::Done;
+}
+
+LaneMachine::LaneMachine() : impl(new Impl) {}
+LaneMachine::~LaneMachine() = default;
+
+bool LaneMachine::run(const Program& program, const InputSource* inputs, size_t count) {
+    impl->error.clear();
+    impl->cancelled.store(false, std::memory_order_relaxed);
+    if (count == 0 || count > LANES || program.impl->image.op_count == 0) return false;
+    return impl->run(program.impl->image, inputs, count);
+}
+
+const std::string& LaneMachine::output(size_t lane) const { return impl->outputs[lane]; }
+void LaneMachine::setMaxSteps(uint64_t steps) { impl->max_steps = steps; }
+void LaneMachine::setTimeLimit(double seconds) { impl->time_limit = seconds; }
+void LaneMachine::cancel() { impl->cancelled.store(true, std::memory_order_relaxed); }
+const std::string& LaneMachine::error() const { return impl->error; }
+
+// One perf event per counter rather than a group, so a counter the CPU
+// lacks (L1d misses in most VMs) drops out alone.
+struct PerfCounters::Impl {
+    enum { CYCLES, INSTRUCTIONS, BRANCHES, BRANCH_MISSES, L1D_MISSES, COUNT };
+    int fds[COUNT] = {-1, -1, -1, -1, -1};
+    bool opened = false;
+    std::string error;
+
+    ~Impl() { close(); }
+
+    void close() {
+#ifdef __linux__
+        for (int& fd : fds) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    bool open() {
+#ifdef __linux__
+        static const struct { uint32_t type; uint64_t config; } events[COUNT] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        };
+        for (int i = 0; i < COUNT; i++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].type;
+            attr.config = events[i].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fds[i] < 0 && i <= INSTRUCTIONS) {
+                error = std::string("perf_event_open: ") + std::strerror(errno);
+                close();
+                return false;
+            }
+        }
+        opened = true;
+        return true;
+#else
+        error = "Hardware counters need Linux";
+        return false;
+#endif
+    }
+
+    void control(unsigned long request) {
+#ifdef __linux__
+        for (int fd : fds)
+            if (fd >= 0) ioctl(fd, request, 0);
+#else
+        (void)request;
+#endif
+    }
+
+    bool read(int i, uint64_t& value) const {
+#ifdef __linux__
+        return fds[i] >= 0 && ::read(fds[i], &value, sizeof(value)) == static_cast<ssize_t>(sizeof(value));
+#else
+        (void)i;
+        (void)value;
+        return false;
+#endif
+    }
+};
+
+PerfCounters::PerfCounters() : impl(new Impl) {}
+PerfCounters::~PerfCounters() = default;
+
+bool PerfCounters::open() { return impl->opened || impl->open(); }
+const std::string& PerfCounters::error() const { return impl->error; }
+
+void PerfCounters::start() {
+#ifdef __linux__
+    if (!impl->opened) return;
+    impl->control(PERF_EVENT_IOC_RESET);
+    impl->control(PERF_EVENT_IOC_ENABLE);
+#endif
+}
+
+PerfReading PerfCounters::stop() {
+    PerfReading reading;
+    if (!impl->opened) return reading;
+#ifdef __linux__
+    impl->control(PERF_EVENT_IOC_DISABLE);
+#endif
+    impl->read(Impl::CYCLES, reading.cycles);
+    impl->read(Impl::INSTRUCTIONS, reading.instructions);
+    reading.has_branches = impl->read(Impl::BRANCHES, reading.branches) &&
+                           impl->read(Impl::BRANCH_MISSES, reading.branch_misses);
+    reading.has_l1d_misses = impl->read(Impl::L1D_MISSES, reading.l1d_misses);
+    return reading;
+}
+
+void PerfCounters::report(const char* engine, const PerfReading& reading, uint64_t ops, std::ostream& os) {
+    auto ratio = [](uint64_t a, uint64_t b) { return b ? static_cast<double>(a) / static_cast<double>(b) : 0.0; };
+    char row[256];
+    int length = std::snprintf(row, sizeof(row), "  %-8s %14llu cycles %14llu instructions  IPC %5.2f",
+                               engine, static_cast<unsigned long long>(reading.cycles),
+                               static_cast<unsigned long long>(reading.instructions),
+                               ratio(reading.instructions, reading.cycles));
+    auto append = [&](const char* format, auto... values) {
+        if (length >= 0 && static_cast<size_t>(length) < sizeof(row))
+            length += std::snprintf(row + length, sizeof(row) - static_cast<size_t>(length), format, values...);
+    };
+    if (reading.has_branches) append("  branch misses %5.2f%%", 100 * ratio(reading.branch_misses, reading.branches));
+    if (reading.has_l1d_misses) append("  L1d misses %llu", static_cast<unsigned long long>(reading.l1d_misses));
+    append("  ops/cycle %6.3f\n", ratio(ops, reading.cycles));
+    os << row;
+}
+
+bool decodeTrace(const std::string& path, const TraceFilter& filter, std::ostream& os, std::string& error) {
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> file(std::fopen(path.c_str(), "rb"), std::fclose);
+    if (!file) {
+        error = "Cannot open " + path;
+        return false;
+    }
+    TraceHeader header;
+    if (std::fread(&header, sizeof(header), 1, file.get()) != 1 || std::memcmp(header.magic, TRACE_MAGIC, 4) != 0) {
+        error = path + " is not a trace file";
+        return false;
+    }
+    if (header.version != TRACE_VERSION || header.endian != BYTECODE_ENDIAN || header.record_size != sizeof(uint64_t)) {
+        error = "Unsupported trace version " + std::to_string(header.version);
+        return false;
+    }
+    std::string code(header.code_size, '\0');
+    if (std::fread(&code[0], 1, code.size(), file.get()) != code.size()) {
+        error = path + " is truncated";
+        return false;
+    }
+    SourceMap source_map;
+    source_map.reset(code.data(), code.size(), header.flags & TRACE_HAS_LINES);
+    // Filtering by line checks every record, so lines are looked up once
+    // per code offset instead.
+    std::vector<uint32_t> lines;
+    if (filter.line) {
+        lines.resize(code.size());
+        uint32_t line = 1;
+        for (size_t i = 0; i < code.size(); i++) {
+            lines[i] = line;
+            if (code[i] == '\n') line++;
+        }
+    }
+
+    std::vector<uint64_t> records(65536);
+    uint64_t step = 0;
+    char row[160];
+    for (size_t count; step <= filter.last_step && (count = std::fread(records.data(), sizeof(uint64_t),
+                                                                          records.size(), file.get())) > 0;) {
+        for (size_t i = 0; i < count && step <= filter.last_step; i++, step++) {
+            uint64_t record = records[i];
+            size_t code_pos = static_cast<uint32_t>(record);
+            size_t pointer = (record >> 32) & 0xffffff;
+            unsigned cell = static_cast<unsigned>(record >> 56);
+            if (code_pos >= code.size()) {
+                error = path + " is corrupt at step " + std::to_string(step);
+                return false;
+            }
+            char command = code[code_pos];
+            if (step < filter.first_step || (filter.pointer != SIZE_MAX && pointer != filter.pointer) ||
+                (filter.line && lines[code_pos] != filter.line) ||
+                (!filter.commands.empty() && filter.commands.find(command) == std::string::npos))
+                continue;
+            std::snprintf(row, sizeof(row), "Step %llu (%s): '%c' ptr=%zu val=%u\n",
+                          static_cast<unsigned long long>(step), SourceMap::format(source_map.locate(code_pos)).c_str(),
+                          command, pointer, cell);
+            os << row;
+        }
+    }
+    if (std::ferror(file.get())) {
+        error = "Cannot read " + path;
+        return false;
+    }
+    return true;
+}
+
+bool benchmarkScanners(const std::string& path, std::ostream& os) {
+    MappedFile mapping;
+    std::string generated;
+    const char* text;
+    size_t size;
+    if (!path.empty()) {
+        if (!mapping.open(path)) { os << "Error: Cannot open " << path << "\n"; return false; }
+        text = reinterpret_cast<const char*>(mapping.data());
+        size = mapping.size();
+    } else {
+        const std::string line = "This line is a comment, then some code: +++[>++<-]>.\n";
+        while (generated.size() < (64u << 20)) generated += line;
+        text = generated.data();
+        size = generated.size();
+    }
+
+    auto report = [size, &os](const char* name, double seconds, size_t commands) {
+        char row[96];
+        std::snprintf(row, sizeof(row), "  %-8s %9.2f ms %9.1f MB/s  %zu commands\n", name, seconds * 1000,
+                      static_cast<double>(size) / 1048576.0 / seconds, commands);
+        os << row;
+    };
+    os << "Scanning " << size << " bytes\n";
+
+    // Best of five runs, reusing the output buffer so page faults on the
+    // first run do not count.
+    std::string expected, commands;
+    auto best = [&](auto&& run) {
+        double fastest = 0;
+        for (int round = 0; round < 5; round++) {
+            commands.clear();
+            auto start = std::chrono::steady_clock::now();
+            run();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (round == 0 || seconds < fastest) fastest = seconds;
+        }
+        return fastest;
+    };
+
+    double seconds = best([&] {
+        for (size_t i = 0; i < size; i++)
+            if (SourceMap::isCommand(text[i])) commands.push_back(text[i]);
+    });
+    expected = commands;
+    report("bytewise", seconds, expected.size());
+
+    bool ok = true;
+    for (const auto& variant : CommandScanner::variants()) {
+        seconds = best([&] { CommandScanner::compact(variant, text, size, commands); });
+        report(variant.name, seconds, commands.size());
+        if (commands != expected) { os << "Error: " << variant.name << " scanner disagrees\n"; ok = false; }
+    }
+    return ok;
+}
+
+bool benchmarkLanes(const std::string& path, std::ostream& os, bool perf_stats) {
+    // Squares each input byte by repeated addition, so every input loops a
+    // different number of times.
+    const char* generated = ",[[->+>+<<]>[->[->+>+<<]>>[-<<+>>]<<<]>>.[-]<[-]<<,]";
+    Program program;
+    if (!(path.empty() ? program.compile(generated) : program.load(path))) {
+        os << "Error: " << program.error() << "\n";
+        return false;
+    }
+
+    const size_t count = 4096;
+    std::vector<std::string> inputs(count);
+    uint32_t seed = 1;
+    auto next = [&seed] {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 16;
+    };
+    for (auto& input : inputs) {
+        input.resize(16 + next() % 49);
+        for (char& c : input) c = static_cast<char>(1 + next() % 32);
+    }
+    auto source = [&inputs](size_t i) {
+        InputSource input;
+        input.data = reinterpret_cast<const unsigned char*>(inputs[i].data());
+        input.size = inputs[i].size();
+        return input;
+    };
+
+    Machine machine;
+    std::vector<char> buffer(65536);
+    machine.output().buffer = buffer.data();
+    machine.output().capacity = buffer.size();
+    machine.output().flush = [](void* user, const char* data, size_t size) {
+        static_cast<std::string*>(user)->append(data, size);
+    };
+    uint64_t steps = 0;
+    auto runScalar = [&](size_t i, std::string& output) {
+        output.clear();
+        machine.output().user = &output;
+        machine.input() = source(i);
+        bool ok = machine.run(program);
+        steps += machine.commands();
+        return ok;
+    };
+
+    auto report = [count, &os](const char* name, double seconds) {
+        char row[96];
+        std::snprintf(row, sizeof(row), "  %-8s %9.2f ms %12.0f inputs/s\n", name, seconds * 1000,
+                      static_cast<double>(count) / seconds);
+        os << row;
+    };
+    auto best = [](auto&& run) {
+        double fastest = 0;
+        for (int round = 0; round < 3; round++) {
+            auto start = std::chrono::steady_clock::now();
+            run();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (round == 0 || seconds < fastest) fastest = seconds;
+        }
+        return fastest;
+    };
+    os << "Running " << count << " inputs\n";
+
+    // Counted over all rounds, with the steps of the scalar rounds as the
+    // work both engines do.
+    PerfCounters counters;
+    if (perf_stats && !counters.open()) {
+        os << "  Hardware counters unavailable: " << counters.error() << "\n";
+        perf_stats = false;
+    }
+    PerfReading scalar_reading, lanes_reading;
+
+    std::vector<std::string> expected(count), actual(count);
+    bool ok = true;
+    counters.start();
+    report("scalar", best([&] {
+        for (size_t i = 0; i < count && ok; i++) ok = runScalar(i, expected[i]);
+    }));
+    scalar_reading = counters.stop();
+    uint64_t scalar_steps = steps;
+    if (!ok) {
+        os << "Error: " << machine.error() << "\n";
+        return false;
+    }
+
+    LaneMachine lanes;
+    size_t fallbacks = 0;
+    counters.start();
+    report("lanes", best([&] {
+        fallbacks = 0;
+        for (size_t first = 0; first < count; first += LaneMachine::LANES) {
+            size_t group = std::min(LaneMachine::LANES, count - first);
+            InputSource sources[LaneMachine::LANES];
+            for (size_t lane = 0; lane < group; lane++) sources[lane] = source(first + lane);
+            if (lanes.run(program, sources, group)) {
+                for (size_t lane = 0; lane < group; lane++) actual[first + lane] = lanes.output(lane);
+            } else {
+                fallbacks++;
+                for (size_t lane = 0; lane < group; lane++) runScalar(first + lane, actual[first + lane]);
+            }
+        }
+    }));
+    lanes_reading = counters.stop();
+    os << "  " << fallbacks << " of " << (count + LaneMachine::LANES - 1) / LaneMachine::LANES
+       << " groups fell back to scalar\n";
+    if (perf_stats) {
+        PerfCounters::report("scalar", scalar_reading, scalar_steps, os);
+        PerfCounters::report("lanes", lanes_reading, scalar_steps, os);
+    }
+    if (actual != expected) {
+        os << "Error: lanes and scalar disagree\n";
+        return false;
+    }
+    return true;
+}
+
+bool checkBudgets(const std::string& path, std::ostream& os) {
+#ifndef TRBBFI_COUNT
+    os << "Error: This build does not count ops; build with -DTRBBFI_COUNT or run make perftest\n";
+    return false;
+#endif
+    std::ifstream budgets(path);
+    if (!budgets) { os << "Error: Cannot open " << path << "\n"; return false; }
+    size_t slash = path.find_last_of("/\\");
+    std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+    std::vector<char> buffer(65536);
+    Machine machine;
+    machine.output().buffer = buffer.data();
+    machine.output().capacity = buffer.size();
+    machine.output().flush = [](void*, const char*, size_t) {};
+
+    bool ok = true;
+    size_t line_number = 0, programs = 0, passed = 0;
+    std::string line;
+    while (std::getline(budgets, line)) {
+        line_number++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string name;
+        unsigned long long op_budget, loop_budget;
+        if (!(fields >> name)) continue;
+        if (!(fields >> op_budget >> loop_budget)) {
+            os << "Error: " << path << ":" << line_number << ": Expected a program and two budgets\n";
+            ok = false;
+            continue;
+        }
+        programs++;
+        Program program;
+        if (!program.load(dir + name)) {
+            os << "Error: " << name << ": " << program.error() << "\n";
+            ok = false;
+            continue;
+        }
+        machine.input() = InputSource();
+        if (!machine.run(program)) {
+            os << "Error: " << name << ": " << machine.error() << "\n";
+            ok = false;
+            continue;
+        }
+        OpCounts counts = machine.counts();
+        bool over = counts.ops > op_budget || counts.loops > loop_budget;
+        bool under = counts.ops < op_budget || counts.loops < loop_budget;
+        char row[160];
+        std::snprintf(row, sizeof(row), "  %-16s %12llu ops (budget %llu) %10llu loops (budget %llu)%s\n", name.c_str(),
+                      static_cast<unsigned long long>(counts.ops), op_budget,
+                      static_cast<unsigned long long>(counts.loops), loop_budget,
+                      over ? "  OVER BUDGET" : under ? "  under, lower the budget" : "");
+        os << row;
+        if (over) ok = false;
+        else passed++;
+    }
+    os << passed << " of " << programs << " programs within budget\n";
+    return ok;
+}
+
+bool Coverage::merge(const Coverage& other) {
+    if (flags.empty()) flags.resize(other.flags.size());
+    if (other.flags.size() != flags.size()) return false;
+    for (size_t i = 0; i < flags.size(); i++) flags[i] |= other.flags[i];
+    runs += other.runs;
+    return true;
+}
+
+namespace {
+
+// Identifies a program by its commands, so reports survive edits to its
+// comments but not to its code.
+std::string programHash(const Program& program) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < program.codeSize(); i++) {
+        if (!SourceMap::isCommand(program.code()[i])) continue;
+        hash = (hash ^ static_cast<unsigned char>(program.code()[i])) * 1099511628211ull;
+    }
+    std::ostringstream os;
+    os << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return os.str();
+}
+
+void writeLocation(std::ostream& os, const SourceLocation& at) {
+    os << "\"offset\": " << at.offset << ", \"line\": " << at.line << ", \"column\": " << at.column;
+}
+
+}  // namespace
+
+bool saveCoverage(const std::string& path, const Program& program, const Coverage& coverage, std::string& error) {
+    if (coverage.flags.size() != program.commandCount()) {
+        error = "Coverage is for a different program";
+        return false;
+    }
+    size_t commands_run = 0, loops = 0, skipped = 0, entered = 0, iterated = 0;
+    std::ostringstream flags, details, not_run;
+    const char* code = program.code();
+    size_t command = 0, gap = 0, gap_start = 0;
+    for (size_t i = 0; i <= program.codeSize(); i++) {
+        bool end = i == program.codeSize();
+        if (!end && !SourceMap::isCommand(code[i])) continue;
+        uint8_t bits = end ? static_cast<uint8_t>(Coverage::RAN) : coverage.flags[command++];
+        if (!end) flags << "0123456789abcdef"[bits & 0xf];
+        if (!(bits & Coverage::RAN)) {
+            if (gap++ == 0) gap_start = i;
+        } else if (gap) {
+            not_run << (not_run.tellp() ? ",\n    " : "\n    ") << "{";
+            writeLocation(not_run, program.locate(gap_start));
+            not_run << ", \"commands\": " << gap << "}";
+            gap = 0;
+        }
+        if (end) break;
+        if (bits & Coverage::RAN) commands_run++;
+        if (code[i] != '[') continue;
+        loops++;
+        skipped += (bits & Coverage::SKIPPED) != 0;
+        entered += (bits & Coverage::ENTERED) != 0;
+        iterated += (bits & Coverage::ITERATED) != 0;
+        details << (details.tellp() ? ",\n    " : "\n    ") << "{";
+        writeLocation(details, program.locate(i));
+        details << ", \"skipped\": " << ((bits & Coverage::SKIPPED) ? "true" : "false")
+                << ", \"entered\": " << ((bits & Coverage::ENTERED) ? "true" : "false")
+                << ", \"iterated\": " << ((bits & Coverage::ITERATED) ? "true" : "false") << "}";
+    }
+    std::ofstream out(path, std::ios::trunc);
+    out << "{\n"
+        << "  \"program_hash\": \"" << programHash(program) << "\",\n"
+        << "  \"runs\": " << coverage.runs << ",\n"
+        << "  \"commands\": " << program.commandCount() << ",\n"
+        << "  \"commands_run\": " << commands_run << ",\n"
+        << "  \"loops\": " << loops << ",\n"
+        << "  \"loops_skipped\": " << skipped << ",\n"
+        << "  \"loops_entered\": " << entered << ",\n"
+        << "  \"loops_iterated\": " << iterated << ",\n"
+        << "  \"flags\": \"" << flags.str() << "\",\n"
+        << "  \"loop_details\": [" << details.str() << (loops ? "\n  " : "") << "],\n"
+        << "  \"not_run\": [" << not_run.str() << (not_run.tellp() ? "\n  " : "") << "]\n"
+        << "}\n";
+    if (!out.flush()) {
+        error = "Cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+bool loadCoverage(const std::string& path, const Program& program, Coverage& coverage, std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = "Cannot open " + path;
+        return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    auto field = [&text](const std::string& name) {
+        size_t at = text.find("\"" + name + "\": ");
+        return at == std::string::npos ? std::string() : text.substr(at + name.size() + 4);
+    };
+    std::string hash = field("program_hash"), runs = field("runs"), flags = field("flags");
+    if (hash.empty() || runs.empty() || flags.size() < 2 || flags[0] != '"') {
+        error = path + " is not a coverage report";
+        return false;
+    }
+    if (hash.compare(0, 18, "\"" + programHash(program) + "\"") != 0) {
+        error = path + " is for a different program";
+        return false;
+    }
+    flags = flags.substr(1, flags.find('"', 1) - 1);
+    if (flags.size() != program.commandCount()) {
+        error = path + " is for a different program";
+        return false;
+    }
+    Coverage loaded;
+    loaded.runs = std::strtoull(runs.c_str(), nullptr, 10);
+    for (char c : flags) {
+        const char* digit = std::strchr("0123456789abcdef", c);
+        if (!c || !digit) {
+            error = path + " is not a coverage report";
+            return false;
+        }
+        loaded.flags.push_back(static_cast<uint8_t>(digit - "0123456789abcdef"));
+    }
+    if (coverage.merge(loaded)) return true;
+    error = path + " is for a different program";
+    return false;
+}
+
+}  // namespace trbbfi
@@ -0,0 +1,3 @@
+Prints 00 to 99 one per line
+++++++++++>++++++++[>++++++>++++++<<-]>>>>++++++++++<<<<<
+[>>>>++++++++++[<<.>.>>.<<+>-]<----------<+<<-]
@@ -0,0 +1,2 @@
+Nested loops that the mul pass turns into multiplications
++++++[>+++++[>+++++[>+++++[>+<-]<-]<-]<-]>>>>.
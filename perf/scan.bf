@@ -0,0 +1,3 @@
+Scans a run of cells right and left fifty times
+>>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+><<<<<<<<<<<<<<<<<<++++++++++++++++++++++++++++++++++++++++++++++++++
+[>>[>]<[<]<-]
@@ -0,0 +1,823 @@
+/*
+ * TRBBFI - The Really Better Brainfuck Interpreter
+ * Author: TheRealOwenJ
+ * Repository: https://github.com/TheRealOwenJ/trbbfi
+ *
+ * Licensed under GNU GPL v3 to prevent theft.
+ * See LICENSE file for details.
+ */
+
+#include "server.h"
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cmath>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+using namespace trbbfi;
+
+namespace {
+
+constexpr uint32_t MAX_FRAME = 128u << 20;
+constexpr size_t REQUEST_HEADER = 24;
+constexpr size_t RESPONSE_HEADER = 44;
+constexpr size_t OUTPUT_LIMIT = 16u << 20;
+constexpr size_t OUTPUT_CHUNK = 65536;
+constexpr size_t CACHE_CAPACITY = 256;
+constexpr size_t POOL_CAPACITY = 64;
+constexpr size_t ISOLATE_MEMORY = 256u << 20;
+constexpr double DEFAULT_TIMEOUT = 60;  // seconds, for runs sent without a limit
+constexpr size_t MAX_CONNECTIONS = 64;
+
+uint64_t hashSource(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    return hash;
+}
+
+void put8(std::string& out, uint8_t value) { out.push_back(static_cast<char>(value)); }
+
+void put32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+void put64(std::string& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+uint32_t get32(const char* data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= static_cast<uint32_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    return value;
+}
+
+uint64_t get64(const char* data) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    return value;
+}
+
+uint64_t nanoseconds(std::chrono::steady_clock::duration duration) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+bool readAll(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t got = ::read(fd, data, size);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        data += got;
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == ENOTSOCK) sent = ::write(fd, data, size);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool readFrame(int fd, std::string& frame) {
+    char length[4];
+    if (!readAll(fd, length, sizeof(length))) return false;
+    uint32_t size = get32(length);
+    if (size > MAX_FRAME) return false;
+    frame.resize(size);
+    return readAll(fd, &frame[0], size);
+}
+
+bool socketAddress(const std::string& path, sockaddr_un& address, std::string& error) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        error = "Socket path '" + path + "' is empty or too long";
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+bool connectTo(const std::string& path, int& fd, std::string& error) {
+    sockaddr_un address;
+    if (!socketAddress(path, address, error)) return false;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { error = std::string("Cannot create socket: ") + std::strerror(errno); return false; }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        error = "Cannot connect to '" + path + "': " + std::strerror(errno);
+        ::close(fd);
+        return false;
+    }
+    return true;
+}
+
+// Recently used programs by the hash of their source. Entries are shared,
+// so evicting one does not disturb a run that is still using it.
+class ProgramCache {
+private:
+    struct Entry {
+        std::shared_ptr<const Program> program;
+        std::list<uint64_t>::iterator position;
+    };
+    std::mutex mutex;
+    std::list<uint64_t> order;
+    std::unordered_map<uint64_t, Entry> entries;
+
+public:
+    std::shared_ptr<const Program> find(uint64_t hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(hash);
+        if (it == entries.end()) return nullptr;
+        order.splice(order.begin(), order, it->second.position);
+        return it->second.program;
+    }
+
+    void insert(uint64_t hash, std::shared_ptr<const Program> program) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(hash);
+        if (it != entries.end()) {
+            it->second.program = std::move(program);
+            order.splice(order.begin(), order, it->second.position);
+            return;
+        }
+        order.push_front(hash);
+        entries[hash] = {std::move(program), order.begin()};
+        if (entries.size() > CACHE_CAPACITY) {
+            entries.erase(order.back());
+            order.pop_back();
+        }
+    }
+};
+
+// Idle machines, which keep the tape they grew on earlier runs.
+class MachinePool {
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Machine>> idle;
+
+public:
+    std::unique_ptr<Machine> acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle.empty()) return std::unique_ptr<Machine>(new Machine);
+        std::unique_ptr<Machine> machine = std::move(idle.back());
+        idle.pop_back();
+        return machine;
+    }
+
+    void release(std::unique_ptr<Machine> machine) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle.size() < POOL_CAPACITY) idle.push_back(std::move(machine));
+    }
+};
+
+// Output collected for a response. A program writing past the limit is
+// stopped at once, by leaving its sink no room, rather than buffered
+// without bound.
+struct Collector {
+    std::string* output;
+    Machine* machine;
+    bool overflow;
+};
+
+void collect(void* user, const char* data, size_t size) {
+    Collector* collector = static_cast<Collector*>(user);
+    if (collector->overflow) return;
+    if (collector->output->size() + size > OUTPUT_LIMIT) {
+        collector->overflow = true;
+        collector->machine->output().capacity = 0;
+        return;
+    }
+    collector->output->append(data, size);
+}
+
+// Passes fd to the other end of a Unix socket along with the first byte
+// of data.
+bool sendWithFd(int socket_fd, const std::string& data, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    std::memset(control, 0, sizeof(control));
+    iovec vector{const_cast<char*>(data.data()), 1};
+    msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    ssize_t sent;
+    do sent = sendmsg(socket_fd, &message, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR);
+    return sent == 1 && writeAll(socket_fd, data.data() + 1, data.size() - 1);
+}
+
+// Reads a frame sent by sendWithFd, setting fd to the descriptor that came
+// with it.
+bool readFrameWithFd(int socket_fd, std::string& frame, int& fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    char length[4];
+    iovec vector{length, 1};
+    msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t got;
+    do got = recvmsg(socket_fd, &message, 0);
+    while (got < 0 && errno == EINTR);
+    cmsghdr* header = got == 1 ? CMSG_FIRSTHDR(&message) : nullptr;
+    if (!header || header->cmsg_type != SCM_RIGHTS) return false;
+    std::memcpy(&fd, CMSG_DATA(header), sizeof(int));
+    if (!readAll(socket_fd, length + 1, 3)) return false;
+    uint32_t size = get32(length);
+    if (size > MAX_FRAME) return false;
+    frame.resize(size);
+    return readAll(socket_fd, &frame[0], size);
+}
+
+int zygote_wake = -1;
+
+void childExited(int) {
+    int saved = errno;
+    char byte = 0;
+    if (::write(zygote_wake, &byte, 1) < 0) {}
+    errno = saved;
+}
+
+class Server {
+private:
+    CompileOptions options;
+    int zygote;
+    std::mutex zygote_mutex;
+    ProgramCache cache;
+    MachinePool pool;
+    // In the zygote, the pipe of each running child. Children are left as
+    // zombies until their status is written and their pipe closed, so the
+    // server cannot kill a pid that has been reused.
+    std::unordered_map<pid_t, int> children;
+
+    std::shared_ptr<const Program> compile(const char* source, size_t size, uint64_t hash, RemoteResult& result) {
+        std::shared_ptr<const Program> program = cache.find(hash);
+        if (program && program->codeSize() == size && std::memcmp(program->code(), source, size) == 0) {
+            result.cached = true;
+            return program;
+        }
+        auto started = std::chrono::steady_clock::now();
+        std::shared_ptr<Program> compiled(new Program);
+        compiled->setCompileOptions(options);
+        compiled->compile(std::string(source, size));
+        result.compile_ns = nanoseconds(std::chrono::steady_clock::now() - started);
+        if (!compiled->valid()) {
+            result.error = compiled->error();
+            return nullptr;
+        }
+        cache.insert(hash, compiled);
+        return compiled;
+    }
+
+    static void run(const Program& program, const RemoteRun& request, double timeout, Machine* machine,
+                    std::vector<char>& buffer, RemoteResult& result) {
+        Collector collector{&result.output, machine, false};
+        OutputSink& sink = machine->output();
+        sink.buffer = buffer.data();
+        sink.capacity = buffer.size();
+        sink.size = 0;
+        sink.flush = collect;
+        sink.user = &collector;
+        InputSource& source = machine->input();
+        source.data = reinterpret_cast<const unsigned char*>(request.input.data());
+        source.size = request.input.size();
+        source.pos = 0;
+        source.read = nullptr;
+        source.closed = true;
+        machine->setTrace("");
+        machine->setMaxSteps(request.max_steps);
+        machine->setTimeLimit(timeout);
+
+        auto started = std::chrono::steady_clock::now();
+        machine->start(program);
+        RunStatus status = machine->resume();
+        result.run_ns = nanoseconds(std::chrono::steady_clock::now() - started);
+        result.steps = machine->steps();
+        if (collector.overflow) {
+            result.status = ServeStatus::Error;
+            result.error = "Output limit exceeded (" + std::to_string(OUTPUT_LIMIT) + " bytes)";
+        } else if (status == RunStatus::Done) {
+            result.status = ServeStatus::Done;
+        } else if (status == RunStatus::FuelExhausted) {
+            result.status = ServeStatus::LimitExceeded;
+            result.error = machine->error();
+        } else {
+            result.status = ServeStatus::Error;
+            result.error = machine->error();
+        }
+        // The buffer belongs to this connection and the input to this
+        // request; neither may outlive them in the pool.
+        sink.buffer = nullptr;
+        sink.capacity = 0;
+        sink.user = nullptr;
+        source.data = nullptr;
+        source.size = 0;
+    }
+
+    // Caps the child: no core dumps, files, processes or CPU time past the
+    // run's time limit, and on Linux no more than ISOLATE_MEMORY of memory
+    // beyond what it started with.
+    static void limitResources(double timeout) {
+        struct rlimit none = {0, 0};
+        setrlimit(RLIMIT_CORE, &none);
+        setrlimit(RLIMIT_FSIZE, &none);
+        setrlimit(RLIMIT_NPROC, &none);
+        rlim_t seconds = static_cast<rlim_t>(std::ceil(timeout)) + 1;
+        struct rlimit cpu = {seconds, seconds + 1};
+        setrlimit(RLIMIT_CPU, &cpu);
+#ifdef __linux__
+        unsigned long pages = 0;
+        if (FILE* statm = std::fopen("/proc/self/statm", "r")) {
+            if (std::fscanf(statm, "%lu", &pages) != 1) pages = 0;
+            std::fclose(statm);
+        }
+        if (pages > 0) {
+            rlim_t bytes = static_cast<rlim_t>(pages) * static_cast<rlim_t>(sysconf(_SC_PAGESIZE)) + ISOLATE_MEMORY;
+            struct rlimit memory = {bytes, bytes};
+            setrlimit(RLIMIT_AS, &memory);
+        }
+#endif
+    }
+
+    static void encode(const RemoteResult& result, std::string& response) {
+        put32(response, static_cast<uint32_t>(RESPONSE_HEADER + result.output.size() + result.error.size()));
+        put8(response, static_cast<uint8_t>(result.status));
+        put8(response, result.cached ? 1 : 0);
+        put8(response, 0);
+        put8(response, 0);
+        put64(response, result.hash);
+        put64(response, result.steps);
+        put64(response, result.compile_ns);
+        put64(response, result.run_ns);
+        put32(response, static_cast<uint32_t>(result.output.size()));
+        put32(response, static_cast<uint32_t>(result.error.size()));
+        response += result.output;
+        response += result.error;
+    }
+
+    // Decodes a request and finds or compiles its program. Returns false
+    // when the frame is malformed; otherwise a missing program means result
+    // holds the response.
+    bool prepare(const std::string& frame, RemoteRun& request, RemoteResult& result,
+                 std::shared_ptr<const Program>& program) {
+        if (frame.size() < REQUEST_HEADER) return false;
+        const char* data = frame.data();
+        uint8_t kind = static_cast<uint8_t>(data[0]);
+        request.max_steps = get64(data + 4);
+        request.timeout = get32(data + 12) / 1000.0;
+        size_t program_size = get32(data + 16), input_size = get32(data + 20);
+        if (kind > 1 || (kind == 1 && program_size != 8) ||
+            frame.size() - REQUEST_HEADER != program_size + input_size)
+            return false;
+        const char* program_data = data + REQUEST_HEADER;
+        request.input.assign(program_data + program_size, input_size);
+
+        if (kind == 1) {
+            result.hash = get64(program_data);
+            program = cache.find(result.hash);
+            result.cached = program != nullptr;
+            if (!program) {
+                result.status = ServeStatus::UnknownProgram;
+                result.error = "Program is not cached";
+            }
+        } else {
+            result.hash = hashSource(program_data, program_size);
+            program = compile(program_data, program_size, result.hash, result);
+        }
+        return true;
+    }
+
+    // Returns false when the frame is malformed and the connection should
+    // be dropped.
+    bool handle(const std::string& frame, std::vector<char>& buffer, std::string& response) {
+        if (zygote >= 0) return forward(frame, response);
+        RemoteRun request;
+        RemoteResult result;
+        std::shared_ptr<const Program> program;
+        if (!prepare(frame, request, result, program)) return false;
+        if (program) {
+            std::unique_ptr<Machine> machine = pool.acquire();
+            run(*program, request, request.timeout > 0 ? request.timeout : DEFAULT_TIMEOUT, machine.get(), buffer,
+                result);
+            pool.release(std::move(machine));
+        }
+        encode(result, response);
+        return true;
+    }
+
+    // Isolated runs are forked from the zygote, a process forked from the
+    // server before it starts any threads, so no child can inherit a lock
+    // held by a thread it does not have. Each request is handed to the
+    // zygote with the write end of a pipe. The zygote answers with the pid
+    // of the child it forked for the run, 0 if it answered the request
+    // itself, or -1 if the request is malformed. The child writes its
+    // response to the pipe, and the zygote adds the child's exit status as
+    // a u32, 256 plus the signal if it was killed, before closing the pipe.
+    // A child still running a second past its time limit is killed.
+    bool forward(const std::string& frame, std::string& response) {
+        if (frame.size() < REQUEST_HEADER) return false;
+        double timeout = get32(frame.data() + 12) / 1000.0;
+        if (timeout <= 0) timeout = DEFAULT_TIMEOUT;
+        RemoteResult result;
+        int fds[2];
+        if (pipe(fds) != 0) {
+            result.error = std::string("Cannot create pipe: ") + std::strerror(errno);
+            encode(result, response);
+            return true;
+        }
+        std::string job, reply(4, '\0');
+        put32(job, static_cast<uint32_t>(frame.size()));
+        job += frame;
+        bool sent;
+        {
+            std::lock_guard<std::mutex> lock(zygote_mutex);
+            sent = sendWithFd(zygote, job, fds[1]) && readAll(zygote, &reply[0], reply.size());
+        }
+        ::close(fds[1]);
+        int32_t pid = static_cast<int32_t>(get32(reply.data()));
+        if (!sent || pid < 0) {
+            ::close(fds[0]);
+            if (sent) return false;
+            result.error = "Isolation process is gone";
+            encode(result, response);
+            return true;
+        }
+
+        readChild(fds[0], pid, timeout, response);
+        ::close(fds[0]);
+        uint32_t status = UINT32_MAX;
+        if (response.size() >= 4) {
+            status = get32(response.data() + response.size() - 4);
+            response.resize(response.size() - 4);
+        }
+        if (status == 0 && response.size() >= 4 && response.size() - 4 == get32(response.data())) return true;
+        response.clear();
+        result.status = ServeStatus::Error;
+        if (status >= 256 && status != UINT32_MAX) result.error = "Run killed by signal " + std::to_string(status - 256);
+        else result.error = "Run failed in its worker process";
+        encode(result, response);
+        return true;
+    }
+
+    // Reads the pipe to its end, killing the child once it outlives its
+    // time limit by a second.
+    static void readChild(int fd, pid_t pid, double timeout, std::string& response) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                                std::chrono::duration<double>(timeout + 1));
+        bool killed = pid == 0;
+        char chunk[OUTPUT_CHUNK];
+        for (;;) {
+            int wait_ms = -1;
+            if (!killed) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                wait_ms = static_cast<int>(std::max<int64_t>(0, left.count()));
+            }
+            pollfd entry{fd, POLLIN, 0};
+            int ready = poll(&entry, 1, wait_ms);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready == 0) {
+                kill(pid, SIGKILL);
+                killed = true;
+                continue;
+            }
+            ssize_t got = ::read(fd, chunk, sizeof(chunk));
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+            response.append(chunk, static_cast<size_t>(got));
+        }
+    }
+
+    void startChild(const std::string& frame, int fd, Machine* machine, std::vector<char>& buffer, int control) {
+        RemoteRun request;
+        RemoteResult result;
+        std::shared_ptr<const Program> program;
+        std::string reply, response;
+        if (!prepare(frame, request, result, program)) {
+            put32(reply, static_cast<uint32_t>(-1));
+            writeAll(control, reply.data(), reply.size());
+            ::close(fd);
+            return;
+        }
+        pid_t pid = program ? fork() : 0;
+        if (pid == 0 && program) {
+            ::close(control);
+            ::close(zygote_wake);
+            for (const auto& child : children) ::close(child.second);
+            signal(SIGCHLD, SIG_DFL);
+            double timeout = request.timeout > 0 ? request.timeout : DEFAULT_TIMEOUT;
+            limitResources(timeout);
+            run(*program, request, timeout, machine, buffer, result);
+            encode(result, response);
+            _exit(writeAll(fd, response.data(), response.size()) ? 0 : 1);
+        }
+        if (pid < 0) {
+            result.error = std::string("Cannot fork: ") + std::strerror(errno);
+            pid = 0;
+        }
+        put32(reply, static_cast<uint32_t>(pid));
+        writeAll(control, reply.data(), reply.size());
+        if (pid > 0) {
+            children[pid] = fd;
+            return;
+        }
+        encode(result, response);
+        put32(response, 0);
+        writeAll(fd, response.data(), response.size());
+        ::close(fd);
+    }
+
+    void reapChildren() {
+        for (;;) {
+            siginfo_t info;
+            std::memset(&info, 0, sizeof(info));
+            if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid == 0) return;
+            pid_t pid = info.si_pid;
+            auto it = children.find(pid);
+            if (it != children.end()) {
+                std::string status;
+                put32(status, info.si_code == CLD_EXITED ? static_cast<uint32_t>(info.si_status & 0xff)
+                                                         : 256 + static_cast<uint32_t>(info.si_status));
+                writeAll(it->second, status.data(), status.size());
+                ::close(it->second);
+                children.erase(it);
+            }
+            while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {}
+        }
+    }
+
+public:
+    Server(const CompileOptions& compile_options, int zygote_fd) : options(compile_options), zygote(zygote_fd) {}
+
+    void serveConnection(int fd) {
+        std::vector<char> buffer(OUTPUT_CHUNK);
+        std::string frame, response;
+        while (readFrame(fd, frame)) {
+            response.clear();
+            if (!handle(frame, buffer, response) || !writeAll(fd, response.data(), response.size())) break;
+        }
+        ::close(fd);
+    }
+
+    // Runs the zygote until the server closes control. It keeps its own
+    // cache of compiled programs, so a child starts from the compiled
+    // program and the zygote's machine.
+    void serveZygote(int control) {
+        int wake[2];
+        if (pipe(wake) != 0) return;
+        fcntl(wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(wake[1], F_SETFL, O_NONBLOCK);
+        zygote_wake = wake[1];
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_handler = childExited;
+        action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigaction(SIGCHLD, &action, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+
+        Machine machine;
+        std::vector<char> buffer(OUTPUT_CHUNK);
+        std::string frame;
+        for (;;) {
+            pollfd entries[2] = {{control, POLLIN, 0}, {wake[0], POLLIN, 0}};
+            if (poll(entries, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            if (entries[1].revents) {
+                char drained[64];
+                while (::read(wake[0], drained, sizeof(drained)) > 0) {}
+                reapChildren();
+            }
+            if (entries[0].revents) {
+                int fd = -1;
+                if (!readFrameWithFd(control, frame, fd)) return;
+                startChild(frame, fd, &machine, buffer, control);
+            }
+        }
+    }
+};
+
+std::atomic<bool> stopping{false};
+int listen_fd = -1;
+
+// Connections being served, each on its own thread. Past MAX_CONNECTIONS
+// the server stops accepting, and new clients wait in the listen backlog.
+std::mutex connection_mutex;
+std::condition_variable connection_closed;
+size_t connections = 0;
+
+void closeConnection() {
+    std::lock_guard<std::mutex> lock(connection_mutex);
+    connections--;
+    connection_closed.notify_one();
+}
+
+// Waits for a free connection slot, looking at stopping now and then,
+// since the signal handler that sets it cannot wake the wait.
+bool awaitConnectionSlot() {
+    std::unique_lock<std::mutex> lock(connection_mutex);
+    while (connections >= MAX_CONNECTIONS)
+        if (connection_closed.wait_for(lock, std::chrono::milliseconds(100)) == std::cv_status::timeout &&
+            stopping.load())
+            return false;
+    connections++;
+    return true;
+}
+
+void stop(int) {
+    stopping.store(true);
+    if (listen_fd >= 0) shutdown(listen_fd, SHUT_RDWR);
+}
+
+// A socket file left behind by a server that is gone is replaced; one
+// that still accepts connections, or any other file, is not.
+bool claimPath(const std::string& path, std::string& error) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) return true;
+    if (!S_ISSOCK(st.st_mode)) {
+        error = "'" + path + "' exists and is not a socket";
+        return false;
+    }
+    int fd;
+    std::string ignored;
+    if (connectTo(path, fd, ignored)) {
+        ::close(fd);
+        error = "A server is already listening on '" + path + "'";
+        return false;
+    }
+    unlink(path.c_str());
+    return true;
+}
+
+}  // namespace
+
+int serve(const std::string& path, const CompileOptions& options, bool isolate) {
+    std::string error;
+    sockaddr_un address;
+    if (!socketAddress(path, address, error) || !claimPath(path, error)) {
+        std::cerr << "Error: " << error << "\n";
+        return 1;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0) {
+        std::cerr << "Error: Cannot listen on '" << path << "': " << std::strerror(errno) << "\n";
+        return 1;
+    }
+
+    // The zygote is forked before the server has any other threads.
+    int zygote = -1;
+    if (isolate) {
+        int pair[2];
+        pid_t pid = -1;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0 && (pid = fork()) == 0) {
+            ::close(pair[0]);
+            ::close(listen_fd);
+            Server(options, -1).serveZygote(pair[1]);
+            std::_Exit(0);
+        }
+        if (pid < 0) {
+            std::cerr << "Error: Cannot start the isolation process: " << std::strerror(errno) << "\n";
+            ::close(listen_fd);
+            unlink(path.c_str());
+            return 1;
+        }
+        ::close(pair[1]);
+        zygote = pair[0];
+    }
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "Serving on " << path << std::endl;
+    Server server(options, zygote);
+    int status = 0;
+    while (!stopping.load() && awaitConnectionSlot()) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            closeConnection();
+            if (errno == EINTR || stopping.load()) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            std::cerr << "Error: accept failed: " << std::strerror(errno) << "\n";
+            status = 1;
+            break;
+        }
+        std::thread([&server, fd] {
+            server.serveConnection(fd);
+            closeConnection();
+        }).detach();
+    }
+    ::close(listen_fd);
+    unlink(path.c_str());
+    std::cout << "Server stopped" << std::endl;
+    // Connections still being served end with the process.
+    std::_Exit(status);
+}
+
+bool runRemote(const std::string& path, const RemoteRun& run, RemoteResult& result, std::string& error) {
+    if (run.source.size() > MAX_FRAME / 2 || run.input.size() > MAX_FRAME / 2) {
+        error = "Program or input too large to send";
+        return false;
+    }
+    int fd;
+    if (!connectTo(path, fd, error)) return false;
+    std::string request;
+    put32(request, static_cast<uint32_t>(REQUEST_HEADER + run.source.size() + run.input.size()));
+    put8(request, 0);
+    put8(request, 0);
+    put8(request, 0);
+    put8(request, 0);
+    put64(request, run.max_steps);
+    put32(request, static_cast<uint32_t>(std::min(run.timeout * 1000.0, 4294967295.0)));
+    put32(request, static_cast<uint32_t>(run.source.size()));
+    put32(request, static_cast<uint32_t>(run.input.size()));
+    request += run.source;
+    request += run.input;
+
+    std::string frame;
+    bool ok = writeAll(fd, request.data(), request.size()) && readFrame(fd, frame);
+    ::close(fd);
+    if (!ok || frame.size() < RESPONSE_HEADER) {
+        error = "Server closed the connection";
+        return false;
+    }
+    const char* data = frame.data();
+    size_t output_size = get32(data + 36), error_size = get32(data + 40);
+    if (static_cast<uint8_t>(data[0]) > static_cast<uint8_t>(ServeStatus::UnknownProgram) ||
+        frame.size() - RESPONSE_HEADER != output_size + error_size) {
+        error = "Malformed response from server";
+        return false;
+    }
+    result.status = static_cast<ServeStatus>(data[0]);
+    result.cached = data[1] != 0;
+    result.hash = get64(data + 4);
+    result.steps = get64(data + 12);
+    result.compile_ns = get64(data + 20);
+    result.run_ns = get64(data + 28);
+    result.output.assign(data + RESPONSE_HEADER, output_size);
+    result.error.assign(data + RESPONSE_HEADER + output_size, error_size);
+    return true;
+}
+
+#else
+
+int serve(const std::string&, const trbbfi::CompileOptions&, bool) {
+    std::cerr << "Error: --serve is not supported on Windows\n";
+    return 1;
+}
+
+bool runRemote(const std::string&, const RemoteRun&, RemoteResult&, std::string& error) {
+    error = "--connect is not supported on Windows";
+    return false;
+}
+
+#endif
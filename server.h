@@ -0,0 +1,72 @@
+/*
+ * TRBBFI - The Really Better Brainfuck Interpreter
+ * Author: TheRealOwenJ
+ * Repository: https://github.com/TheRealOwenJ/trbbfi
+ *
+ * Licensed under GNU GPL v3 to prevent theft.
+ * See LICENSE file for details.
+ */
+
+// Daemon mode: a long-lived process that runs programs sent over a Unix
+// socket, keeping compiled programs and tapes between requests.
+//
+// Every frame starts with its length as a u32, not counting the length
+// itself. Integers are little-endian. A client may send any number of
+// requests without waiting; responses come back in the same order.
+//
+// Request:  u8 kind (0 = source, 1 = program hash), u8 0, u16 0,
+//           u64 max_steps, u32 timeout_ms, u32 program_size,
+//           u32 input_size, program, input
+// Response: u8 status (ServeStatus), u8 cached, u16 0, u64 program hash,
+//           u64 steps, u64 compile_ns, u64 run_ns, u32 output_size,
+//           u32 error_size, output, error
+//
+// A timeout_ms of 0 gives the run the server's default of 60 seconds. A
+// program sent by hash must already be in the cache, which holds the
+// most recently used programs by the hash of their source; otherwise the
+// response is UnknownProgram and the client should send the source.
+
+#ifndef TRBBFI_SERVER_H
+#define TRBBFI_SERVER_H
+
+#include "trbbfi.h"
+
+#include <cstdint>
+#include <string>
+
+enum class ServeStatus : uint8_t {
+    Done,
+    Error,
+    LimitExceeded,
+    UnknownProgram,
+};
+
+struct RemoteRun {
+    std::string source;
+    std::string input;
+    uint64_t max_steps = 0;
+    double timeout = 0;
+};
+
+struct RemoteResult {
+    ServeStatus status = ServeStatus::Error;
+    bool cached = false;
+    uint64_t hash = 0;
+    uint64_t steps = 0;
+    uint64_t compile_ns = 0;
+    uint64_t run_ns = 0;
+    std::string output;
+    std::string error;
+};
+
+// Serves requests on a socket at path until SIGINT or SIGTERM, compiling
+// with the given options. With isolate, each run happens in a child forked
+// from a single-threaded zygote process and capped with setrlimit, so a
+// crash or runaway run cannot take the server down. Returns the process exit code.
+int serve(const std::string& path, const trbbfi::CompileOptions& options, bool isolate);
+
+// Sends one run to the server at path. Returns false with error set when
+// the server cannot be reached or breaks the protocol.
+bool runRemote(const std::string& path, const RemoteRun& run, RemoteResult& result, std::string& error);
+
+#endif
@@ -7,152 +7,404 @@
  * See LICENSE file for details.
  */
 
+#include "trbbfi.h"
+#include "server.h"
+#include "batch.h"
+
 #include <iostream>
 #include <fstream>
-#include <vector>
-#include <stack>
+#include <iterator>
 #include <string>
 #include <sstream>
+#include <iomanip>
+#include <vector>
 #include <algorithm>
-#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <chrono>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
 
-#define TRBBFI_VERSION "1.0"
 #define TRBBFI_BUILD_DATE __DATE__
 
+using namespace trbbfi;
+
+static const char* const DEFAULT_TRACE = "trbbfi.trace";
+static constexpr uint64_t DEFAULT_HISTORY = 1 << 20;
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Peak resident set size of the process in bytes, 0 where unknown.
+static uint64_t peakRss() {
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// Runs programs on stdin and stdout for the shell and the command line,
+// printing errors where the original single-file interpreter did.
 class BrainfuckInterpreter {
 private:
-    std::vector<unsigned char> memory;
-    std::vector<char> code;
-    size_t memptr;
-    size_t codeptr;
-    std::stack<size_t> loop_stack;
-    bool debug_mode;
+    Program program;
+    Machine machine;
+    std::vector<char> output_buffer;
+    std::vector<unsigned char> replay;
+    std::ofstream recording;
+    std::string trace_path;
+    bool paused = false;
+    bool history = false;
+    bool perf_stats = false;
+    std::string profile_path;
+    std::string coverage_path;
+    std::string profile_root;
+    double compile_seconds = 0;
+    double run_seconds = 0;
+
+    static constexpr size_t OUTPUT_BUFFER_SIZE = 65536;
+    static constexpr size_t HEAT_ROWS = 32;
+    static Machine* interrupted;
+    static Machine* profiled;
+
+    // The first Ctrl-C cancels the run and the next one kills the process,
+    // since a program waiting for input only notices once it gets some.
+    static void interrupt(int) {
+        std::signal(SIGINT, SIG_DFL);
+        if (interrupted) interrupted->cancel();
+    }
+
+#ifndef _WIN32
+    static void sampleProfile(int) {
+        if (profiled) profiled->sample();
+    }
+
+    // Samples the run every millisecond of CPU time, or stops sampling.
+    static bool profileTimer(bool on) {
+        struct itimerval timer = {};
+        timer.it_interval.tv_usec = on ? 1000 : 0;
+        timer.it_value.tv_usec = on ? 1000 : 0;
+        return setitimer(ITIMER_PROF, &timer, nullptr) == 0;
+    }
+#endif
+
+    static void writeStdout(void*, const char* data, size_t size) {
+        std::cout.write(data, static_cast<std::streamsize>(size));
+        std::cout.flush();
+    }
+
+    static int readStdin(void*) {
+        int input = std::cin.get();
+        if (std::cin.fail()) {
+            std::cin.clear();
+            return -1;
+        }
+        return input;
+    }
+
+    static int readAndRecord(void* user) {
+        int input = readStdin(nullptr);
+        if (input >= 0) static_cast<std::ofstream*>(user)->put(static_cast<char>(input));
+        return input;
+    }
 
 public:
-    BrainfuckInterpreter() : memory(30000, 0), memptr(0), codeptr(0), debug_mode(false) {}
+    BrainfuckInterpreter() : output_buffer(OUTPUT_BUFFER_SIZE) {
+        OutputSink& sink = machine.output();
+        sink.buffer = output_buffer.data();
+        sink.capacity = output_buffer.size();
+        sink.flush = writeStdout;
+        machine.input().read = readStdin;
+    }
 
-    void setDebug(bool debug) { debug_mode = debug; }
+    void setTrace(const std::string& path) {
+        trace_path = path;
+        machine.setTrace(path);
+    }
+    void setLimits(uint64_t max_steps, double timeout) {
+        machine.setMaxSteps(max_steps);
+        machine.setTimeLimit(timeout);
+    }
+    void setCompileOptions(const CompileOptions& options) { program.setCompileOptions(options); }
+    void setPerfStats(bool on) { perf_stats = on; }
+    void setProfile(const std::string& path, const std::string& root) {
+        profile_path = path;
+        profile_root = root;
+        machine.setProfiling(!path.empty());
+    }
 
-    void loadCode(const std::string& program) {
-        code.clear();
-        for (char c : program) {
-            if (c == '>' || c == '<' || c == '+' || c == '-' ||
-                c == '.' || c == ',' || c == '[' || c == ']') {
-                code.push_back(c);
-            }
+    // Saves every byte the program reads from stdin to path.
+    bool recordInput(const std::string& path) {
+        recording.open(path, std::ios::binary | std::ios::trunc);
+        if (!recording) {
+            std::cerr << "Error: Cannot create " << path << "\n";
+            return false;
         }
+        InputSource& source = machine.input();
+        source.read = readAndRecord;
+        source.user = &recording;
+        return true;
     }
 
-    bool validateBrackets() {
-        int balance = 0;
-        for (char c : code) {
-            if (c == '[') balance++;
-            if (c == ']') balance--;
-            if (balance < 0) return false;
+    // Feeds the program the bytes in path instead of stdin. They are read
+    // up front, so a timed run does no input I/O.
+    bool replayInput(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            std::cerr << "Error: Cannot open " << path << "\n";
+            return false;
         }
-        return balance == 0;
+        replay.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        InputSource& source = machine.input();
+        source = InputSource();
+        source.data = replay.data();
+        source.size = replay.size();
+        return true;
+    }
+    static bool isPass(const std::string& name) { return Program::isPass(name); }
+
+    // Bracket errors are left for execute() to report.
+    void loadCode(const std::string& code) {
+        paused = false;
+        auto started = std::chrono::steady_clock::now();
+        program.compile(code);
+        compile_seconds = secondsSince(started);
     }
 
-    void reset() {
-        std::fill(memory.begin(), memory.end(), 0);
-        memptr = 0;
-        codeptr = 0;
-        while (!loop_stack.empty()) loop_stack.pop();
+    bool loadFile(const std::string& path) {
+        paused = false;
+        auto started = std::chrono::steady_clock::now();
+        bool loaded = program.load(path);
+        compile_seconds = secondsSince(started);
+        if (loaded) return true;
+        std::cerr << "Error: " << program.error() << "\n";
+        return false;
     }
 
-    bool execute() {
-        if (!validateBrackets()) {
-            std::cerr << "Error: Unmatched brackets\n";
+    std::string sourcePreview(size_t length) const {
+        return std::string(program.code() ? program.code() : "", std::min(length, program.codeSize()));
+    }
+
+    bool checkBrackets() const {
+        if (program.valid()) return true;
+        std::cerr << "Error: " << program.error() << "\n";
+        return false;
+    }
+
+    bool saveBytecode(const std::string& path) const {
+        if (program.saveBytecode(path)) return true;
+        std::cerr << "Error: " << program.error() << "\n";
+        return false;
+    }
+
+    int executeBatch(const BatchOptions& options) {
+        if (!checkBrackets()) return 1;
+        if (coverage_path.empty()) return runBatch(program, options);
+        BatchOptions covered = options;
+        Coverage coverage;
+        covered.coverage = &coverage;
+        int result = runBatch(program, covered);
+        return writeCoverage(coverage) ? result : 1;
+    }
+
+    void setCoverage(const std::string& path) {
+        coverage_path = path;
+        machine.setCoverage(!path.empty());
+    }
+
+    // Adds coverage to the report at coverage_path, which is created if it
+    // does not exist yet.
+    bool writeCoverage(const Coverage& coverage) {
+        Coverage total;
+        std::string error;
+        if (std::ifstream(coverage_path) && !loadCoverage(coverage_path, program, total, error)) {
+            std::cerr << "Error: " << error << "\n";
+            return false;
+        }
+        if (!total.merge(coverage) || !saveCoverage(coverage_path, program, total, error)) {
+            std::cerr << "Error: " << (error.empty() ? "Coverage is for a different program" : error) << "\n";
             return false;
         }
+        size_t ran = static_cast<size_t>(std::count_if(total.flags.begin(), total.flags.end(),
+                                                       [](uint8_t flags) { return flags & Coverage::RAN; }));
+        std::cerr << "Coverage written to " << coverage_path << ": " << ran << " of " << total.flags.size()
+                  << " commands ran over " << total.runs << (total.runs == 1 ? " run" : " runs") << "\n";
+        return true;
+    }
 
-        codeptr = 0;
-        memptr = 0;
-        while (!loop_stack.empty()) loop_stack.pop();
-        std::fill(memory.begin(), memory.end(), 0);
+    bool execute() {
+        if (!checkBrackets()) return false;
+        PerfCounters counters;
+        bool counting = perf_stats && counters.open();
+        if (perf_stats && !counting) std::cerr << "Hardware counters unavailable: " << counters.error() << "\n";
+        if (!startProfile()) return false;
+        auto started = std::chrono::steady_clock::now();
+        counters.start();
+        bool ok = machine.run(program);
+        PerfReading reading = counters.stop();
+        run_seconds = secondsSince(started);
+        if (!ok) std::cout << "\nError: " << machine.error() << "\n";
+        if (!finishProfile()) return false;
+        if (!coverage_path.empty()) {
+            Coverage coverage;
+            machine.addCoverage(coverage);
+            if (!writeCoverage(coverage)) return false;
+        }
+        if (counting)
+            PerfCounters::report(trace_path.empty() ? "compiled" : "source", reading, machine.commands(), std::cerr);
+        if (!trace_path.empty()) std::cerr << "Trace written to " << trace_path << "\n";
+        if (recording.is_open() && !recording.flush()) {
+            std::cerr << "Error: Cannot write the input recording\n";
+            return false;
+        }
+        return ok;
+    }
 
-        while (codeptr < code.size()) {
-            if (debug_mode) {
-                std::cerr << "[DEBUG] Step " << codeptr << ": '" << code[codeptr]
-                          << "' ptr=" << memptr << " val=" << (int)memory[memptr] << std::endl;
-            }
+    bool startProfile() {
+        if (profile_path.empty()) return true;
+#ifndef _WIN32
+        struct sigaction action = {};
+        action.sa_handler = sampleProfile;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        profiled = &machine;
+        if (sigaction(SIGPROF, &action, nullptr) == 0 && profileTimer(true)) return true;
+        profiled = nullptr;
+#endif
+        std::cerr << "Error: Cannot start the profiler\n";
+        return false;
+    }
 
-            switch (code[codeptr]) {
-                case '>':
-                    memptr++;
-                    if (memptr >= memory.size()) {
-                        if (memory.size() >= 1000000) {
-                            std::cout << "\nError: Memory limit exceeded (1MB)\n";
-                            return false;
-                        }
-                        memory.resize(std::min(memory.size() * 2, size_t(1000000)), 0);
-                    }
-                    break;
-                case '<':
-                    if (memptr > 0) memptr--;
-                    break;
-                case '+':
-                    memory[memptr]++;
-                    break;
-                case '-':
-                    memory[memptr]--;
-                    break;
-                case '.':
-                    std::cout << (char)memory[memptr];
-                    std::cout.flush();
-                    break;
-                case ',':
-                {
-                    int input = std::cin.get();
-                    if (std::cin.fail()) {
-                        std::cin.clear();
-                        memory[memptr] = 0;
-                    } else {
-                        memory[memptr] = (input == EOF) ? 0 : (unsigned char)input;
-                    }
-                    break;
-                }
-                case '[':
-                    if (memory[memptr] == 0) {
-                        int balance = 1;
-                        size_t pos = codeptr + 1;
-                        while (pos < code.size() && balance > 0) {
-                            if (code[pos] == '[') balance++;
-                            if (code[pos] == ']') balance--;
-                            pos++;
-                        }
-                        if (balance > 0) {
-                            std::cout << "\nError: Unmatched '[' at position " << codeptr << "\n";
-                            return false;
-                        }
-                        codeptr = pos - 1;
-                    } else {
-                        loop_stack.push(codeptr);
-                    }
-                    break;
-                case ']':
-                    if (loop_stack.empty()) {
-                        std::cout << "\nError: Unmatched ']' at position " << codeptr << "\n";
-                        return false;
-                    }
-                    if (memory[memptr] != 0) {
-                        codeptr = loop_stack.top();
-                    } else {
-                        loop_stack.pop();
-                    }
-                    break;
-            }
-            codeptr++;
+    bool finishProfile() {
+        if (profile_path.empty()) return true;
+#ifndef _WIN32
+        profileTimer(false);
+        profiled = nullptr;
+#endif
+        std::ofstream out(profile_path, std::ios::trunc);
+        machine.writeProfile(out, profile_root);
+        if (!out.flush()) {
+            std::cerr << "Error: Cannot write " << profile_path << "\n";
+            return false;
         }
+        std::cerr << "Profile written to " << profile_path << "\n";
         return true;
     }
 
+    // Shell runs stop at breakpoints and watchpoints, and proceed() carries
+    // on from there.
+    bool start() {
+        if (!checkBrackets()) return false;
+        machine.start(program);
+        run_seconds = 0;
+        return proceed(0);
+    }
+
+    // Runs count commands one at a time, or with count 0 until the program
+    // ends or stops again.
+    bool proceed(uint64_t count) {
+        if (!paused && count) {
+            machine.start(program);
+            run_seconds = 0;
+        }
+        return report(interruptible([this, count] { return count ? machine.step(count) : machine.resume(); }));
+    }
+
+    // Moves the run to just before the given command of its history.
+    bool travel(uint64_t command) {
+        if (!history) {
+            std::cout << "Error: History is off; use 'history on' and run again\n";
+            return false;
+        }
+        return report(interruptible([this, command] { return machine.travel(command); }));
+    }
+
+    // Travels back count commands from where the run stopped.
+    bool reverseStep(uint64_t count) {
+        uint64_t now = machine.commands();
+        return travel(now > count ? now - count : 0);
+    }
+
+    void setHistory(uint64_t interval) {
+        history = interval != 0;
+        machine.setHistory(interval);
+    }
+    bool historyOn() const { return history; }
+
+    // Ctrl-C cancels the program instead of the shell.
+    template <typename Run>
+    RunStatus interruptible(Run&& run) {
+        interrupted = &machine;
+        auto previous = std::signal(SIGINT, interrupt);
+        auto started = std::chrono::steady_clock::now();
+        RunStatus status = run();
+        run_seconds += secondsSince(started);
+        std::signal(SIGINT, previous == SIG_ERR ? SIG_DFL : previous);
+        interrupted = nullptr;
+        return status;
+    }
+
+    bool report(RunStatus status) {
+        paused = status == RunStatus::Stopped;
+        if (paused) {
+            showStop();
+            return true;
+        }
+        if (status != RunStatus::Done) std::cout << "\nError: " << machine.error() << "\n";
+        if (!trace_path.empty()) std::cerr << "Trace written to " << trace_path << "\n";
+        return status == RunStatus::Done;
+    }
+
+    bool isPaused() const { return paused; }
+
+    void showStop() {
+        if (!machine.error().empty()) std::cout << "\n" << machine.error() << "\n";
+        size_t at = machine.location();
+        std::cout << "Step " << machine.commands() << ", ";
+        if (at < program.codeSize())
+            std::cout << Program::formatLocation(program.locate(at)) << ": '" << program.code()[at] << "'\n";
+        else
+            std::cout << "end of program\n";
+        size_t memptr = machine.pointer();
+        dumpMemory(memptr > 8 ? memptr - 8 : 0, 16);
+    }
+
+    void addBreakpoint(size_t code_index) { machine.addBreakpoint(code_index); }
+    bool addWatchpoint(size_t cell) {
+        if (machine.addWatchpoint(cell)) return true;
+        std::cout << "Error: " << machine.error() << "\n";
+        return false;
+    }
+    void clearBreakpoints() {
+        machine.clearBreakpoints();
+        machine.clearWatchpoints();
+    }
+
+    void reset() {
+        machine.reset();
+        paused = false;
+    }
+
     void dumpMemory(size_t start = 0, size_t count = 16) {
-        if (start >= memory.size()) {
-            std::cout << "Error: Start position " << start << " exceeds memory size " << memory.size() << "\n";
+        const unsigned char* memory = machine.tape();
+        size_t size = machine.tapeSize(), memptr = machine.pointer();
+        if (start >= size) {
+            std::cout << "Error: Start position " << start << " exceeds memory size " << size << "\n";
             return;
         }
-        size_t end = std::min(start + count, memory.size());
+        size_t end = std::min(start + count, size);
         std::cout << "Memory [" << start << "-" << (end - 1) << "]: ";
         for (size_t i = start; i < end; i++) {
             if (i == memptr) std::cout << "[" << (int)memory[i] << "] ";
@@ -161,18 +413,93 @@ public:
         std::cout << "\n";
     }
 
-    size_t getCodeSize() const { return code.size(); }
-    size_t getMemoryPointer() const { return memptr; }
+    void setTapeHeatmap(size_t region) { machine.setTapeHeatmap(region); }
+
+    // Accesses of the last run per tape region, as a histogram of at most
+    // HEAT_ROWS rows that each cover one or more regions.
+    void dumpHeat(std::ostream& os) const {
+        TapeHeat heat = machine.tapeHeat();
+        size_t regions = heat.reads.size(), touched = 0;
+        for (size_t i = 0; i < regions; i++) touched += heat.reads[i] || heat.writes[i];
+        size_t per_row = std::max<size_t>(1, (regions + HEAT_ROWS - 1) / HEAT_ROWS);
+        std::vector<std::pair<uint64_t, uint64_t>> rows((regions + per_row - 1) / per_row);
+        uint64_t hottest = 1;
+        for (size_t i = 0; i < regions; i++) {
+            rows[i / per_row].first += heat.reads[i];
+            rows[i / per_row].second += heat.writes[i];
+        }
+        for (const auto& row : rows) hottest = std::max(hottest, row.first + row.second);
+        os << "Tape heat map (" << heat.region * per_row << (heat.region * per_row == 1 ? " cell" : " cells")
+           << " per row):\n"
+           << "  " << std::left << std::setw(16) << "cells" << std::right << std::setw(14) << "reads"
+           << std::setw(14) << "writes" << "\n";
+        for (size_t r = 0; r < rows.size(); r++) {
+            size_t first = r * per_row * heat.region;
+            std::string range = std::to_string(first) + "-" + std::to_string(first + per_row * heat.region - 1);
+            uint64_t total = rows[r].first + rows[r].second;
+            os << "  " << std::left << std::setw(16) << range << std::right << std::setw(14) << rows[r].first
+               << std::setw(14) << rows[r].second;
+            if (total) os << "  " << std::string(1 + total * 39 / hottest, '#');
+            os << "\n";
+        }
+        os << "Working set: " << touched * heat.region << " cells in " << touched << " regions of " << heat.region
+           << "\n";
+    }
+
+    // One line per region up to the last one accessed, for plotting.
+    bool writeHeatCsv(const std::string& path) const {
+        TapeHeat heat = machine.tapeHeat();
+        std::ofstream out(path, std::ios::trunc);
+        out << "first_cell,last_cell,reads,writes\n";
+        for (size_t i = 0; i < heat.reads.size(); i++)
+            out << i * heat.region << "," << (i + 1) * heat.region - 1 << "," << heat.reads[i] << "," << heat.writes[i]
+                << "\n";
+        if (out.flush()) return true;
+        std::cerr << "Error: Cannot write " << path << "\n";
+        return false;
+    }
+
+    // Counters of the last load and run, as text or as one JSON object.
+    // IR ops are only counted by a TRBBFI_COUNT build and left out otherwise.
+    void printStats(std::ostream& os, bool json) const {
+        RunStats stats = machine.stats();
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(json ? 6 : 3);
+        if (json) {
+            out << "{\"compile_seconds\": " << compile_seconds << ", \"run_seconds\": " << run_seconds
+                << ", \"steps\": " << stats.steps;
+            if (stats.counted) out << ", \"ir_ops\": " << stats.counts.ops;
+            out << ", \"loops_entered\": " << stats.counts.loops << ", \"input_bytes\": " << stats.input_bytes
+                << ", \"output_bytes\": " << stats.output_bytes << ", \"tape_cells\": " << stats.tape_cells
+                << ", \"peak_rss_bytes\": " << peakRss() << "}\n";
+        } else {
+            out << "Stats:\n  Compile time: " << compile_seconds * 1000 << " ms"
+                << "\n  Run time: " << run_seconds * 1000 << " ms"
+                << "\n  Steps: " << stats.steps;
+            if (stats.counted) out << "\n  IR ops: " << stats.counts.ops;
+            out << "\n  Loops entered: " << stats.counts.loops
+                << "\n  Input bytes: " << stats.input_bytes
+                << "\n  Output bytes: " << stats.output_bytes
+                << "\n  Tape cells: " << stats.tape_cells
+                << "\n  Peak RSS: " << static_cast<double>(peakRss()) / 1048576.0 << " MB\n";
+        }
+        os << out.str();
+    }
+
+    size_t getCodeSize() const { return program.commandCount(); }
+    size_t getMemoryPointer() const { return machine.pointer(); }
 };
 
+Machine* BrainfuckInterpreter::interrupted = nullptr;
+Machine* BrainfuckInterpreter::profiled = nullptr;
+
 class Shell {
 private:
     BrainfuckInterpreter interpreter;
     std::string current_program;
-    bool debug_mode;
+    std::string trace_path;
 
 public:
-    Shell() : debug_mode(false) {}
 
     void printBanner() {
         std::cout << "TRBBFI v" << TRBBFI_VERSION << " - The Really Better Brainfuck Interpreter\n";
@@ -184,13 +511,24 @@ public:
         std::cout << "TRBBFI - Brainfuck Interpreter Commands:\n";
         std::cout << "  load <file.bf>     - Load brainfuck program from file\n";
         std::cout << "  code <program>     - Load brainfuck program from command line\n";
-        std::cout << "  run (or r)         - Execute loaded brainfuck program\n";
+        std::cout << "  run (or r)         - Execute loaded brainfuck program (Ctrl-C stops it)\n";
+        std::cout << "  break <offset>     - Stop before the command at offset into the program\n";
+        std::cout << "  watch <cell>       - Stop when a memory cell changes\n";
+        std::cout << "  delete             - Remove all breakpoints and watchpoints\n";
+        std::cout << "  continue (or cont) - Carry on after a stop\n";
+        std::cout << "  step [n]           - Run n commands (default 1), then stop\n";
+        std::cout << "  history on [n]     - Checkpoint runs every n steps (default 1048576)\n";
+        std::cout << "  history off        - Stop checkpointing\n";
+        std::cout << "  reverse-step [n]   - Go back n commands (default 1)\n";
+        std::cout << "  goto step <k>      - Go to just before command k of the run\n";
         std::cout << "  reset              - Reset interpreter state (clear memory)\n";
         std::cout << "  dump [start] [cnt] - Show memory contents\n";
-        std::cout << "  debug [on|off]     - Toggle debug mode (shows step-by-step)\n";
+        std::cout << "  debug on [file]    - Trace every step to file (default " << DEFAULT_TRACE << ")\n";
+        std::cout << "  debug off          - Stop tracing\n";
         std::cout << "  show (or s)        - Show loaded brainfuck program\n";
         std::cout << "  clear (or c)       - Clear loaded program\n";
         std::cout << "  status             - Show interpreter status\n";
+        std::cout << "  stats [json]       - Show counters of the last run\n";
         std::cout << "  help (or h)        - Show this help\n";
         std::cout << "  exit/quit/q        - Exit TRBBFI\n";
     }
@@ -231,15 +569,8 @@ public:
                     if (tokens.size() < 2) { std::cout << "Usage: load <file.bf>\n"; continue; }
                     std::string filename = tokens[1];
                     if (filename.find("..") != std::string::npos) { std::cout << "Error: Invalid filename\n"; continue; }
-                    std::ifstream file(filename, std::ios::binary);
-                    if (!file) { std::cout << "Error: Cannot open file\n"; continue; }
-                    file.seekg(0, std::ios::end);
-                    size_t filesize = file.tellg();
-                    if (filesize > 1000000) { std::cout << "Error: File too large\n"; continue; }
-                    file.seekg(0, std::ios::beg);
-                    std::string program((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-                    interpreter.loadCode(program);
-                    current_program = program;
+                    if (!interpreter.loadFile(filename)) continue;
+                    current_program = interpreter.sourcePreview(200);
                     std::cout << "Loaded " << interpreter.getCodeSize() << " instructions from " << filename << "\n";
                 } else if (cmd == "code") {
                     if (tokens.size() < 2) { std::cout << "Usage: code <program>\n"; continue; }
@@ -251,7 +582,44 @@ public:
                     std::cout << "Loaded " << interpreter.getCodeSize() << " instructions\n";
                 } else if (cmd == "run" || cmd == "r") {
                     if (current_program.empty()) std::cout << "No program loaded.\n";
-                    else if (!interpreter.execute()) std::cout << "Program failed.\n";
+                    else if (!interpreter.start()) std::cout << "Program failed.\n";
+                } else if (cmd == "continue" || cmd == "cont") {
+                    if (!interpreter.isPaused()) std::cout << "The program is not stopped.\n";
+                    else if (!interpreter.proceed(0)) std::cout << "Program failed.\n";
+                } else if (cmd == "step") {
+                    uint64_t count = tokens.size() > 1 ? std::stoull(tokens[1]) : 1;
+                    if (current_program.empty()) std::cout << "No program loaded.\n";
+                    else if (count == 0) std::cout << "Usage: step [n]\n";
+                    else if (!interpreter.proceed(count)) std::cout << "Program failed.\n";
+                } else if (cmd == "history") {
+                    if (tokens.size() > 1 && tokens[1] == "on") {
+                        uint64_t interval = tokens.size() > 2 ? std::stoull(tokens[2]) : DEFAULT_HISTORY;
+                        if (interval == 0) { std::cout << "Usage: history on [n]\n"; continue; }
+                        interpreter.setHistory(interval);
+                        std::cout << "Checkpointing every " << interval << " steps from the next run\n";
+                    } else if (tokens.size() > 1 && tokens[1] == "off") {
+                        interpreter.setHistory(0);
+                        std::cout << "History off\n";
+                    } else std::cout << "Usage: history on [n] | history off\n";
+                } else if (cmd == "reverse-step") {
+                    uint64_t count = tokens.size() > 1 ? std::stoull(tokens[1]) : 1;
+                    if (!interpreter.reverseStep(count)) std::cout << "Program failed.\n";
+                } else if (cmd == "goto") {
+                    size_t arg = tokens.size() > 1 && tokens[1] == "step" ? 2 : 1;
+                    if (tokens.size() <= arg) { std::cout << "Usage: goto step <k>\n"; continue; }
+                    if (!interpreter.travel(std::stoull(tokens[arg]))) std::cout << "Program failed.\n";
+                } else if (cmd == "break") {
+                    if (tokens.size() < 2) { std::cout << "Usage: break <offset>\n"; continue; }
+                    size_t offset = std::stoul(tokens[1]);
+                    interpreter.addBreakpoint(offset);
+                    std::cout << "Breakpoint at offset " << offset << "\n";
+                } else if (cmd == "watch") {
+                    if (tokens.size() < 2) { std::cout << "Usage: watch <cell>\n"; continue; }
+                    size_t cell = std::stoul(tokens[1]);
+                    if (interpreter.addWatchpoint(cell)) std::cout << "Watching cell " << cell << "\n";
+                } else if (cmd == "delete") {
+                    interpreter.clearBreakpoints();
+                    std::cout << "Breakpoints and watchpoints removed\n";
                 } else if (cmd == "reset") { interpreter.reset(); std::cout << "Interpreter reset\n"; }
                 else if (cmd == "dump") {
                     size_t start = 0, count = 16;
@@ -261,10 +629,14 @@ public:
                 } else if (cmd == "debug" || cmd == "d") {
                     if (tokens.size() > 1) {
                         std::string arg = tokens[1]; std::transform(arg.begin(), arg.end(), arg.begin(), ::tolower);
-                        if (arg == "on") { interpreter.setDebug(true); debug_mode = true; std::cout << "Debug mode on\n"; }
-                        else if (arg == "off") { interpreter.setDebug(false); debug_mode = false; std::cout << "Debug mode off\n"; }
-                        else std::cout << "Usage: debug [on|off]\n";
-                    } else std::cout << "Usage: debug [on|off]\n";
+                        if (arg == "on") {
+                            trace_path = tokens.size() > 2 ? tokens[2] : DEFAULT_TRACE;
+                            interpreter.setTrace(trace_path);
+                            std::cout << "Tracing to " << trace_path << "\n";
+                        }
+                        else if (arg == "off") { trace_path.clear(); interpreter.setTrace(""); std::cout << "Tracing off\n"; }
+                        else std::cout << "Usage: debug on [file] | debug off\n";
+                    } else std::cout << "Usage: debug on [file] | debug off\n";
                 } else if (cmd == "show" || cmd == "s") {
                     if (current_program.empty()) std::cout << "No program loaded\n";
                     else std::cout << "Program (" << interpreter.getCodeSize() << " instructions): "
@@ -274,7 +646,10 @@ public:
                     std::cout << "Status:\n  Program loaded: " << (current_program.empty() ? "No" : "Yes")
                               << "\n  Instructions: " << interpreter.getCodeSize()
                               << "\n  Memory pointer: " << interpreter.getMemoryPointer()
-                              << "\n  Debug mode: " << (debug_mode ? "On" : "Off") << "\n";
+                              << "\n  Trace: " << (trace_path.empty() ? "Off" : trace_path)
+                              << "\n  History: " << (interpreter.historyOn() ? "On" : "Off") << "\n";
+                } else if (cmd == "stats") {
+                    interpreter.printStats(std::cout, tokens.size() > 1 && tokens[1] == "json");
                 } else { std::cout << "Unknown command: " << cmd << "\n"; }
             } catch (...) { std::cout << "Error occurred\n"; }
         }
@@ -285,9 +660,31 @@ public:
 
 struct Options {
     std::string code;
-    bool debug = false;
+    std::string trace;
     bool help = false;
     bool version = false;
+    std::string emit;
+    std::string output;
+    bool bench_scan = false;
+    bool bench_lanes = false;
+    bool perf_stats = false;
+    std::string stats;
+    std::string perftest;
+    std::string profile;
+    std::string coverage;
+    bool heatmap = false;
+    std::string heatmap_csv;
+    size_t heat_region = 16;
+    uint64_t max_steps = 0;
+    double timeout = 0;
+    std::string serve;
+    bool isolate = false;
+    BatchOptions batch;
+    std::string connect;
+    std::string record_input;
+    std::string replay_input;
+    std::string error;
+    CompileOptions compile;
     std::vector<std::string> files;
 };
 
@@ -298,7 +695,62 @@ Options parseArgs(int argc, char* argv[]) {
         if (arg == "-h" || arg == "--help") opts.help = true;
         else if (arg == "-v" || arg == "--version") opts.version = true;
         else if (arg == "-c" && i + 1 < argc) { opts.code = argv[++i]; }
-        else if (arg == "-d" || arg == "--debug") opts.debug = true;
+        else if (arg == "-d" || arg == "--debug") opts.trace = DEFAULT_TRACE;
+        else if (arg.rfind("--trace=", 0) == 0) opts.trace = arg.substr(8);
+        else if (arg.rfind("--emit=", 0) == 0) opts.emit = arg.substr(7);
+        else if (arg == "-o" && i + 1 < argc) { opts.output = argv[++i]; }
+        else if (arg == "--bench-scan") opts.bench_scan = true;
+        else if (arg == "--bench-lanes") opts.bench_lanes = true;
+        else if (arg == "--perf-stats") opts.perf_stats = true;
+        else if (arg == "--stats") opts.stats = "text";
+        else if (arg.rfind("--stats=", 0) == 0) {
+            opts.stats = arg.substr(8);
+            if (opts.stats != "text" && opts.stats != "json") opts.error = "Unknown stats format '" + opts.stats + "'";
+        }
+        else if (arg.rfind("--profile=", 0) == 0) opts.profile = arg.substr(10);
+        else if (arg == "--coverage" && i + 1 < argc) { opts.coverage = argv[++i]; }
+        else if (arg == "--tape-heatmap") opts.heatmap = true;
+        else if (arg.rfind("--tape-heatmap=", 0) == 0) { opts.heatmap = true; opts.heatmap_csv = arg.substr(15); }
+        else if (arg.rfind("--heat-region=", 0) == 0) {
+            char* end = nullptr;
+            unsigned long region = std::strtoul(arg.c_str() + 14, &end, 10);
+            if (arg.size() == 14 || *end || region == 0 || region > 65536)
+                opts.error = "Invalid heat map region '" + arg.substr(14) + "'";
+            opts.heat_region = region;
+        }
+        else if (arg == "--perftest" && i + 1 < argc) { opts.perftest = argv[++i]; }
+        else if (arg == "--serve" && i + 1 < argc) { opts.serve = argv[++i]; }
+        else if (arg == "--connect" && i + 1 < argc) { opts.connect = argv[++i]; }
+        else if (arg == "--isolate") opts.isolate = true;
+        else if (arg == "--inputs" && i + 1 < argc) { opts.batch.inputs = argv[++i]; }
+        else if (arg == "--out" && i + 1 < argc) { opts.batch.outputs = argv[++i]; }
+        else if (arg == "--lanes") opts.batch.lanes = true;
+        else if (arg == "--record-input" && i + 1 < argc) { opts.record_input = argv[++i]; }
+        else if (arg == "--replay-input" && i + 1 < argc) { opts.replay_input = argv[++i]; }
+        else if (arg == "-j" && i + 1 < argc) {
+            char* end = nullptr;
+            unsigned long jobs = std::strtoul(argv[++i], &end, 10);
+            if (*end || jobs == 0 || jobs > 4096) opts.error = "Invalid job count '" + std::string(argv[i]) + "'";
+            opts.batch.jobs = static_cast<unsigned>(jobs);
+        }
+        else if (arg.rfind("--max-steps=", 0) == 0) {
+            char* end = nullptr;
+            opts.max_steps = std::strtoull(arg.c_str() + 12, &end, 10);
+            if (arg.size() == 12 || *end || arg[12] == '-') opts.error = "Invalid step limit '" + arg.substr(12) + "'";
+        } else if (arg.rfind("--timeout=", 0) == 0) {
+            char* end = nullptr;
+            opts.timeout = std::strtod(arg.c_str() + 10, &end);
+            if (arg.size() == 10 || *end || !(opts.timeout >= 0)) opts.error = "Invalid timeout '" + arg.substr(10) + "'";
+        }
+        else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3') {
+            opts.compile.opt_level = arg[2] - '0';
+        } else if (arg.rfind("--passes=", 0) == 0) {
+            std::stringstream ss(arg.substr(9));
+            std::string pass;
+            while (std::getline(ss, pass, ',')) if (!pass.empty()) opts.compile.passes.push_back(pass);
+        } else if (arg == "--time-passes") opts.compile.time_passes = true;
+        else if (arg == "--dump-ir") opts.compile.dump_ir = true;
+        else if (arg.rfind("--dump-ir=", 0) == 0) { opts.compile.dump_ir = true; opts.compile.dump_after = arg.substr(10); }
         else opts.files.push_back(arg);
     }
     return opts;
@@ -310,40 +762,210 @@ void printUsage(const char* prog_name) {
               << "  " << prog_name << "           # Start shell\n"
               << "  " << prog_name << " file.bf    # Execute file\n"
               << "  " << prog_name << " -c code     # Execute code\n"
-              << "  " << prog_name << " -d         # Debug mode\n"
+              << "  " << prog_name << " -d         # Trace every step to " << DEFAULT_TRACE << "\n"
+              << "  " << prog_name << " --trace=file # Trace every step to file\n"
+              << "  " << prog_name << " trace-decode file [--from=N] [--to=N] [--ptr=N] [--line=N] [--commands=chars] # Print a trace\n"
+              << "  " << prog_name << " file.bf --emit=bytecode -o file.bfc # Compile to bytecode\n"
+              << "  " << prog_name << " file.bfc   # Execute bytecode\n"
+              << "  " << prog_name << " -O0..-O3   # Optimization level (default -O2)\n"
+              << "  " << prog_name << " --passes=fold,dce,clear,mul,block # Custom pass order\n"
+              << "  " << prog_name << " --time-passes # Print compile time of each pass\n"
+              << "  " << prog_name << " --dump-ir[=pass] # Print IR, after the given pass or all of them\n"
+              << "  " << prog_name << " --max-steps=N # Stop after about N steps\n"
+              << "  " << prog_name << " --timeout=SECONDS # Stop after this much run time\n"
+              << "  " << prog_name << " file.bf --record-input in.bin # Save the bytes read from stdin\n"
+              << "  " << prog_name << " file.bf --replay-input in.bin # Read input from a file loaded up front\n"
+              << "  " << prog_name << " --serve path.sock # Run programs sent to a Unix socket\n"
+              << "  " << prog_name << " --serve path.sock --isolate # Run each in a forked, rlimited process\n"
+              << "  " << prog_name << " --connect path.sock file.bf # Run on a server, with stdin read to the end first\n"
+              << "  " << prog_name << " file.bf --inputs dir --out dir [-j N] [--lanes] # Run on every file in dir\n"
+              << "  " << prog_name << " --bench-scan [file] # Benchmark source filtering\n"
+              << "  " << prog_name << " --bench-lanes [file] # Benchmark the lockstep engine against the scalar one\n"
+              << "  " << prog_name << " file.bf --stats[=json] # Print run counters to stderr\n"
+              << "  " << prog_name << " file.bf --profile=out.folded # Sample where the run spends its time\n"
+              << "  " << prog_name << " file.bf --coverage out.json # Add the commands and loops the run covered\n"
+              << "  " << prog_name << " file.bf --tape-heatmap[=out.csv] [--heat-region=N] # Print tape accesses per region\n"
+              << "  " << prog_name << " file.bf --perf-stats # Print hardware counters of the run (Linux)\n"
+              << "  " << prog_name << " --perftest budgets.txt # Check op counts against budgets (counting build)\n"
               << "  " << prog_name << " -h|--help  # Help\n"
               << "  " << prog_name << " -v|--version # Version\n";
 }
 
+// Runs the program on a server instead of in this process.
+int runOnServer(const Options& opts) {
+    RemoteRun run;
+    if (!opts.code.empty()) {
+        run.source = opts.code;
+    } else if (!opts.files.empty()) {
+        std::ifstream file(opts.files[0], std::ios::binary);
+        if (!file) { std::cerr << "Error: Cannot open " << opts.files[0] << "\n"; return 1; }
+        run.source.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (run.source.compare(0, 4, "TRBC") == 0) {
+            std::cerr << "Error: Bytecode cannot be run on a server\n";
+            return 1;
+        }
+    } else {
+        std::cerr << "Error: No program to run\n";
+        return 1;
+    }
+    if (!opts.replay_input.empty()) {
+        std::ifstream file(opts.replay_input, std::ios::binary);
+        if (!file) { std::cerr << "Error: Cannot open " << opts.replay_input << "\n"; return 1; }
+        run.input.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    } else {
+        run.input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    }
+    if (!opts.record_input.empty()) {
+        std::ofstream file(opts.record_input, std::ios::binary | std::ios::trunc);
+        if (!file.write(run.input.data(), static_cast<std::streamsize>(run.input.size()))) {
+            std::cerr << "Error: Cannot write " << opts.record_input << "\n";
+            return 1;
+        }
+    }
+    run.max_steps = opts.max_steps;
+    run.timeout = opts.timeout;
+
+    RemoteResult result;
+    std::string error;
+    if (!runRemote(opts.connect, run, result, error)) {
+        std::cerr << "Error: " << error << "\n";
+        return 1;
+    }
+    std::cout << result.output;
+    if (result.status == ServeStatus::Done) return 0;
+    std::cout << "\nError: " << result.error << "\n";
+    return 1;
+}
+
 void printVersion() {
     std::cout << "TRBBFI v" << TRBBFI_VERSION << " by TheRealOwenJ\n"
               << "Licensed under GNU GPL v3\n"
               << "https://github.com/TheRealOwenJ/trbbfi\n";
 }
 
+// trbbfi trace-decode file [filters]
+int decodeTraceFile(int argc, char* argv[]) {
+    TraceFilter filter;
+    std::string path;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        auto number = [&arg](size_t skip, uint64_t& value) {
+            char* end = nullptr;
+            value = std::strtoull(arg.c_str() + skip, &end, 10);
+            return arg.size() > skip && !*end && arg[skip] != '-';
+        };
+        uint64_t value = 0;
+        bool ok = true;
+        if (arg.rfind("--from=", 0) == 0) ok = number(7, filter.first_step);
+        else if (arg.rfind("--to=", 0) == 0) ok = number(5, filter.last_step);
+        else if (arg.rfind("--ptr=", 0) == 0) { ok = number(6, value); filter.pointer = static_cast<size_t>(value); }
+        else if (arg.rfind("--line=", 0) == 0) { ok = number(7, value) && value; filter.line = static_cast<size_t>(value); }
+        else if (arg.rfind("--commands=", 0) == 0) filter.commands = arg.substr(11);
+        else if (path.empty()) path = arg;
+        else ok = false;
+        if (!ok) { std::cerr << "Error: Invalid argument '" << arg << "'\n"; return 1; }
+    }
+    if (path.empty()) {
+        std::cerr << "Usage: " << argv[0] << " trace-decode file [--from=N] [--to=N] [--ptr=N] [--line=N] [--commands=chars]\n";
+        return 1;
+    }
+    std::ios::sync_with_stdio(false);
+    std::string error;
+    if (decodeTrace(path, filter, std::cout, error)) return 0;
+    std::cerr << "Error: " << error << "\n";
+    return 1;
+}
+
 int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "trace-decode") return decodeTraceFile(argc, argv);
+
     BrainfuckInterpreter interpreter;
     Shell shell;
     Options opts = parseArgs(argc, argv);
 
-    interpreter.setDebug(opts.debug);
+    interpreter.setTrace(opts.trace);
+    interpreter.setCompileOptions(opts.compile);
+    interpreter.setLimits(opts.max_steps, opts.timeout);
+    interpreter.setPerfStats(opts.perf_stats);
+    interpreter.setCoverage(opts.coverage);
+    if (opts.heatmap) interpreter.setTapeHeatmap(opts.heat_region);
 
     if (opts.help) { printUsage(argv[0]); return 0; }
     if (opts.version) { printVersion(); return 0; }
+    if (!opts.error.empty()) { std::cerr << "Error: " << opts.error << "\n"; return 1; }
+    if (!opts.record_input.empty() && !opts.replay_input.empty()) {
+        std::cerr << "Error: --record-input and --replay-input cannot be combined\n";
+        return 1;
+    }
+    if (!opts.serve.empty()) return serve(opts.serve, opts.compile, opts.isolate);
+    if (!opts.connect.empty()) return runOnServer(opts);
+    if (opts.bench_scan) return benchmarkScanners(opts.files.empty() ? "" : opts.files[0], std::cout) ? 0 : 1;
+    if (opts.bench_lanes) return benchmarkLanes(opts.files.empty() ? "" : opts.files[0], std::cout, opts.perf_stats) ? 0 : 1;
+    if (!opts.perftest.empty()) return checkBudgets(opts.perftest, std::cout) ? 0 : 1;
+
+    for (const auto& pass : opts.compile.passes) {
+        if (!BrainfuckInterpreter::isPass(pass)) { std::cerr << "Error: Unknown pass '" << pass << "'\n"; return 1; }
+    }
+    const std::string& dump_after = opts.compile.dump_after;
+    if (!dump_after.empty() && dump_after != "lower" && !BrainfuckInterpreter::isPass(dump_after)) {
+        std::cerr << "Error: Unknown pass '" << dump_after << "'\n";
+        return 1;
+    }
+
+    if (!opts.emit.empty() && opts.emit != "bytecode") {
+        std::cerr << "Error: Unknown emit format '" << opts.emit << "'\n";
+        return 1;
+    }
 
     if (!opts.code.empty()) {
         interpreter.loadCode(opts.code);
-        return interpreter.execute() ? 0 : 1;
+    } else if (!opts.files.empty()) {
+        if (!interpreter.loadFile(opts.files[0])) return 1;
+    } else if (!opts.emit.empty()) {
+        std::cerr << "Error: No program to compile\n";
+        return 1;
+    } else if (!opts.batch.inputs.empty() || !opts.batch.outputs.empty()) {
+        std::cerr << "Error: No program to run\n";
+        return 1;
+    } else {
+        shell.run();
+        return 0;
     }
 
-    if (!opts.files.empty()) {
-        std::ifstream file(opts.files[0], std::ios::binary);
-        if (!file) { std::cerr << "Error opening file\n"; return 1; }
-        std::string program((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-        interpreter.loadCode(program);
-        return interpreter.execute() ? 0 : 1;
+    if (!opts.batch.inputs.empty() || !opts.batch.outputs.empty()) {
+        if (opts.batch.inputs.empty() || opts.batch.outputs.empty()) {
+            std::cerr << "Error: --inputs and --out must be given together\n";
+            return 1;
+        }
+        if (!opts.record_input.empty() || !opts.replay_input.empty()) {
+            std::cerr << "Error: Batch inputs cannot be recorded or replayed\n";
+            return 1;
+        }
+        opts.batch.max_steps = opts.max_steps;
+        opts.batch.timeout = opts.timeout;
+        return interpreter.executeBatch(opts.batch);
     }
 
-    shell.run();
-    return 0;
+    if (!opts.emit.empty()) {
+        if (opts.output.empty()) { std::cerr << "Error: --emit requires -o <file>\n"; return 1; }
+        if (!interpreter.checkBrackets()) return 1;
+        return interpreter.saveBytecode(opts.output) ? 0 : 1;
+    }
+    if (!opts.profile.empty()) {
+        if (!opts.trace.empty()) {
+            std::cerr << "Error: --profile cannot be combined with tracing\n";
+            return 1;
+        }
+        std::string root = opts.files.empty() ? "program" : opts.files[0];
+        interpreter.setProfile(opts.profile, root.substr(root.find_last_of("/\\") + 1));
+    }
+    if (!opts.record_input.empty() && !interpreter.recordInput(opts.record_input)) return 1;
+    if (!opts.replay_input.empty() && !interpreter.replayInput(opts.replay_input)) return 1;
+    bool ok = interpreter.execute();
+    if (!opts.stats.empty()) interpreter.printStats(std::cerr, opts.stats == "json");
+    if (opts.heatmap) {
+        interpreter.dumpHeat(std::cerr);
+        if (!opts.heatmap_csv.empty() && !interpreter.writeHeatCsv(opts.heatmap_csv)) return 1;
+    }
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,399 @@
+/*
+ * TRBBFI - The Really Better Brainfuck Interpreter
+ * Author: TheRealOwenJ
+ * Repository: https://github.com/TheRealOwenJ/trbbfi
+ *
+ * Licensed under GNU GPL v3 to prevent theft.
+ * See LICENSE file for details.
+ */
+
+// Embedding API. A Program is compiled once and can be run by any number of
+// Machines; a Machine keeps its tape between runs and does its I/O through
+// caller-owned buffers and callbacks, so running allocates nothing once the
+// tape has grown to what the program needs.
+
+#ifndef TRBBFI_H
+#define TRBBFI_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#define TRBBFI_VERSION "1.0"
+
+namespace trbbfi {
+
+struct CompileOptions {
+    int opt_level = 2;
+    std::vector<std::string> passes;
+    bool time_passes = false;
+    bool dump_ir = false;
+    std::string dump_after;
+};
+
+struct SourceLocation {
+    size_t offset;
+    size_t line;
+    size_t column;
+};
+
+// Where a machine writes output. Bytes go straight into buffer[size...];
+// when the buffer is full, before input is read and when a run ends, flush
+// is called with the bytes written so far and size goes back to 0. Without
+// a flush callback the bytes stay in the buffer, and filling it suspends a
+// resumable run with OutputReady and fails a blocking one. A flush
+// callback may set capacity to 0 to stop the run the same way at once.
+struct OutputSink {
+    char* buffer = nullptr;
+    size_t capacity = 0;
+    size_t size = 0;
+    void (*flush)(void* user, const char* data, size_t size) = nullptr;
+    void* user = nullptr;
+};
+
+// Where a machine reads input from: data[pos, size) first, then the read
+// callback, which returns the next byte or -1 at end of input. A read past
+// the end of input stores 0. Without a callback, a resumable run that runs
+// out of data suspends with NeedInput unless closed is set.
+struct InputSource {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+    int (*read)(void* user) = nullptr;
+    void* user = nullptr;
+    bool closed = false;
+};
+
+// Work done by a run. Unlike time, the counts are the same on every machine.
+// Ops are counted only in a build with TRBBFI_COUNT defined.
+struct OpCounts {
+    uint64_t ops = 0;    // ops dispatched, or commands run by a guard's fallback
+    uint64_t loops = 0;  // loops entered rather than skipped
+};
+
+// What a machine's current or last run has done so far.
+struct RunStats {
+    uint64_t steps = 0;         // commands run, as Machine::commands()
+    uint64_t input_bytes = 0;
+    uint64_t output_bytes = 0;
+    size_t tape_cells = 0;      // up to the furthest cell the pointer reached
+    bool counted = false;       // whether counts.ops was kept
+    OpCounts counts;
+};
+
+// Which commands of a program ran, over one or more runs, and what each
+// loop did. flags holds one entry per command of the program, in order;
+// a '[' also says whether its loop was ever skipped, entered, or iterated
+// more than once.
+struct Coverage {
+    enum : uint8_t { RAN = 1, SKIPPED = 2, ENTERED = 4, ITERATED = 8 };
+    std::vector<uint8_t> flags;
+    uint64_t runs = 0;
+
+    // Adds the runs of other, which must be for the same program.
+    bool merge(const Coverage& other);
+};
+
+// Reads and writes of each region of the tape, region cells at a time, up
+// to the last region accessed.
+struct TapeHeat {
+    size_t region = 0;
+    std::vector<uint64_t> reads;
+    std::vector<uint64_t> writes;
+};
+
+enum class RunStatus {
+    Done,           // the program finished
+    NeedInput,      // input is empty; add data or set closed, then resume
+    OutputReady,    // the output buffer is full; take it, reset size, resume
+    Error,          // error() says why
+    FuelExhausted,  // a step or time limit was reached; raise it and resume
+    Cancelled,      // cancel() was called; the run is over
+    Stopped,        // a breakpoint, watchpoint or step() stopped the run; resume
+};
+
+// A compiled program. Compiling from a file maps it and keeps the mapping
+// for the program's lifetime; compiling from memory keeps a pointer to it
+// unless the source is passed as a string, which is copied. A compiled
+// program is never modified by running it.
+class Program {
+public:
+    Program();
+    ~Program();
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+
+    void setCompileOptions(const CompileOptions& options);
+    static bool isPass(const std::string& name);
+
+    // Each returns false and sets error() when the program cannot be run,
+    // including when its brackets do not match. A failed load() leaves the
+    // program it replaces loaded.
+    bool compile(const std::string& source);
+    bool compile(const char* source, size_t size);
+    bool load(const std::string& path);
+    bool saveBytecode(const std::string& path) const;
+
+    bool valid() const;
+    const std::string& error() const;
+
+    // The text locations refer to: the source, or for bytecode the
+    // commands alone.
+    const char* code() const;
+    size_t codeSize() const;
+    size_t commandCount() const;
+    size_t findUnmatchedBracket() const;
+    SourceLocation locate(size_t code_index) const;
+    static std::string formatLocation(const SourceLocation& loc);
+    void dumpIR(std::ostream& os) const;
+
+private:
+    friend class Machine;
+    friend class LaneMachine;
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Tape, pointer and I/O for running programs.
+class Machine {
+public:
+    Machine();
+    ~Machine();
+    Machine(const Machine&) = delete;
+    Machine& operator=(const Machine&) = delete;
+
+    OutputSink& output();
+    InputSource& input();
+
+    // Records every command with the pointer and cell to a binary trace
+    // file at path, running the source one command at a time. Each run
+    // truncates the file, which is complete once the run ends; read it
+    // with decodeTrace(). An empty path turns tracing off.
+    void setTrace(const std::string& path);
+
+    // Runs the program from a cleared tape to the end. Empty input reads
+    // as end of input and a full output buffer is an error. On failure
+    // error() says why and the output written so far has been flushed.
+    bool run(const Program& program);
+
+    // Resumable runs: start() clears the tape and loads the program, and
+    // each resume() runs until the program ends or has to wait for input
+    // or output room. The tape, pointer and position in the program stay
+    // in the machine between calls, so the program must outlive the run.
+    void start(const Program& program);
+    RunStatus resume();
+
+    // Limits checked as the program loops, in steps (commands run, with a
+    // collapsed loop counting as the iterations it replaced) and in seconds
+    // spent inside run() or resume(). 0 means no limit. Reaching one fails
+    // run() and suspends a resumable run with FuelExhausted.
+    void setMaxSteps(uint64_t steps);
+    void setTimeLimit(double seconds);
+    uint64_t steps() const;
+
+    // Counts since start(); ops stay 0 unless built with TRBBFI_COUNT.
+    OpCounts counts() const;
+    RunStats stats() const;
+
+    // Stops the current run from any thread, or from a signal handler. The
+    // run notices within about a million steps, flushes its output and ends
+    // with Cancelled; run() fails with error() "Cancelled". A run blocked
+    // in an input callback stops only once the callback returns. start()
+    // clears the request.
+    void cancel();
+
+    // Sampling profiler. With profiling on, start() sets up a run that
+    // publishes where it is at each jump, and each sample() counts a hit on
+    // the straight run of ops it is in. sample() is meant to be called from
+    // a SIGPROF handler on the running thread and is safe there.
+    // writeProfile() then writes the hits in collapsed-stack format, one
+    // line per source line and loop nest, such as
+    // "root;loop at line 2, column 5;line 3 42", ready for flamegraph tools.
+    void setProfiling(bool on);
+    void sample();
+    void writeProfile(std::ostream& os, const std::string& root) const;
+
+    // Coverage. With coverage on, start() sets up a run that marks each
+    // loop as it is skipped, entered and iterated, a few bits per loop, and
+    // addCoverage() adds the finished or stopped run to coverage.
+    void setCoverage(bool on);
+    void addCoverage(Coverage& coverage) const;
+
+    // Tape heat map. With a region size, start() sets up a run that counts
+    // reads and writes of the tape per region of that many cells, rounded
+    // up to a power of two; 0 turns it off. Accesses count per source
+    // command, so the counts are the same at every optimization level.
+    void setTapeHeatmap(size_t region);
+    TapeHeat tapeHeat() const;
+
+    // Debugging. A breakpoint stops a run before the command at the given
+    // offset into the program's code(), and a watchpoint just after the
+    // command that changed the cell. resume() then returns Stopped with
+    // error() saying why, and calling it again carries on. The compiled
+    // program runs at full speed until one fires: breakpoints are patched
+    // as traps into this machine's copy of it, and the tape pages holding
+    // watched cells are write-protected. After a write to one, the last
+    // stretch of up to a million steps is run again one command at a time
+    // to find the change, so one undone later is still caught. On Windows
+    // watched cells are only compared once per stretch. Only one machine in
+    // the process can run with watchpoints at a time; another stops with an
+    // error. While watches are set, output passed to the sink's flush
+    // callback is held back to the start of the stretch, so nothing written
+    // after the change gets out; without a flush callback it cannot be.
+    void addBreakpoint(size_t code_index);
+    bool addWatchpoint(size_t cell);
+    void clearBreakpoints();
+    void clearWatchpoints();
+
+    // Runs count more commands, then returns Stopped with error() empty,
+    // unless a breakpoint or watchpoint stops the run first. Most of the
+    // way runs compiled, and the source runs the last stretch.
+    RunStatus step(uint64_t count);
+
+    // Offset into code() of the command the run will execute next.
+    size_t location() const;
+
+    // Time travel. With an interval, the next start() keeps a checkpoint of
+    // the run at the first loop back-edge after every interval steps, and
+    // logs the input it reads. travel() then moves a stopped or finished run
+    // to just before the given command, counting from 0, by restoring the
+    // last checkpoint before it and running the rest at full speed. Output
+    // already written through the flush callback is not written again.
+    // Returns Stopped there, or how the run ended if it ends first. Not
+    // available while tracing. 0 turns history off.
+    void setHistory(uint64_t interval);
+    RunStatus travel(uint64_t command);
+
+    // Commands run so far, each counted every time it runs. Exact whenever
+    // the run has stopped between two commands.
+    uint64_t commands() const;
+
+    void reset();
+    const std::string& error() const;
+
+    const unsigned char* tape() const;
+    size_t tapeSize() const;
+    size_t pointer() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Experimental lockstep engine for running one program on many inputs. It
+// runs up to LANES inputs at once with each tape cell holding one byte per
+// input in a SIMD register. Inputs that leave a loop early are masked off
+// until the rest catch up. Where they cannot catch up, run() returns false
+// and the inputs should be run one at a time on a Machine instead. That
+// happens when a loop does not bring the pointer back to where it started,
+// when the pointer goes below cell 0 in a block, or when the memory or
+// output limit is reached. Only the data of each InputSource is read, from
+// pos on, and the output of each input is kept until the next run.
+class LaneMachine {
+public:
+    static constexpr size_t LANES = 16;
+
+    LaneMachine();
+    ~LaneMachine();
+    LaneMachine(const LaneMachine&) = delete;
+    LaneMachine& operator=(const LaneMachine&) = delete;
+
+    bool run(const Program& program, const InputSource* inputs, size_t count);
+    const std::string& output(size_t lane) const;
+
+    // Limits as on a Machine, for each run(). A loop is charged once for
+    // all the lanes in it, and a Set for the lane it runs longest in, so
+    // the charge can pass a limit no single input does: reaching one fails
+    // run() with error() empty, and the inputs should then be run one at
+    // a time to hold each to it on its own. cancel() stops the current run
+    // from any thread, failing it with error() "Cancelled".
+    void setMaxSteps(uint64_t steps);
+    void setTimeLimit(double seconds);
+    void cancel();
+    const std::string& error() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Hardware counters of the calling thread around a stretch of code, read
+// with perf_event_open on Linux. Counters the CPU or kernel does not offer
+// read as 0 with their flag unset.
+struct PerfReading {
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t branches = 0;
+    uint64_t branch_misses = 0;
+    uint64_t l1d_misses = 0;
+    bool has_branches = false;
+    bool has_l1d_misses = false;
+};
+
+class PerfCounters {
+public:
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Returns false with error() saying why when cycles and instructions
+    // cannot be counted, as on other platforms or under a strict
+    // perf_event_paranoid. start() and stop() then do nothing.
+    bool open();
+    void start();
+    PerfReading stop();
+    const std::string& error() const;
+
+    // Prints IPC, branch-miss rate, L1d misses and ops per cycle of a
+    // reading taken while the named engine ran ops BF steps.
+    static void report(const char* engine, const PerfReading& reading, uint64_t ops, std::ostream& os);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Which records of a trace decodeTrace() prints. Steps count from 0.
+struct TraceFilter {
+    uint64_t first_step = 0;
+    uint64_t last_step = UINT64_MAX;
+    size_t pointer = SIZE_MAX;  // only this cell, SIZE_MAX for any
+    size_t line = 0;            // only this source line, 0 for any
+    std::string commands;       // only these commands, empty for any
+};
+
+// Prints the records of the trace file at path that pass the filter, one
+// per line. Returns false with error set if the file is not a trace.
+bool decodeTrace(const std::string& path, const TraceFilter& filter, std::ostream& os, std::string& error);
+
+// Times the byte-at-a-time command filter against each vectorized scanner
+// the CPU supports, over the file at path or over a generated source when
+// path is empty. Returns false if any scanner disagrees.
+bool benchmarkScanners(const std::string& path, std::ostream& os);
+
+// Writes coverage of program as a JSON report: totals, each loop with
+// what it did, and the ranges of commands that never ran. loadCoverage()
+// reads a report back, so later runs can be merged into it.
+bool saveCoverage(const std::string& path, const Program& program, const Coverage& coverage, std::string& error);
+bool loadCoverage(const std::string& path, const Program& program, Coverage& coverage, std::string& error);
+
+// Times a Machine against a LaneMachine running the program at path, or a
+// generated one when path is empty, over a set of generated inputs. With
+// perf_stats, also prints hardware counters for each engine. Returns false
+// if their outputs differ.
+bool benchmarkLanes(const std::string& path, std::ostream& os, bool perf_stats);
+
+// Runs each program listed in the budget file at path with no input and
+// compares its op counts with the budgets given for it. Each line holds a
+// program, relative to the budget file, then its op and loop budgets; #
+// starts a comment. Returns false if any run fails or goes over budget,
+// or if this build does not count.
+bool checkBudgets(const std::string& path, std::ostream& os);
+
+}  // namespace trbbfi
+
+#endif